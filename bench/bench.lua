@@ -0,0 +1,181 @@
+-- Throughput benchmarks for the template compiler and renderer.
+--
+-- Run from the bench directory with the module in LUA_CPATH, or use
+-- "make bench".  BENCH_TIME sets the seconds spent per measurement.
+
+local template = require 'template'
+
+local DURATION = tonumber(os.getenv('BENCH_TIME')) or 1
+local BATCH = 100
+
+os.execute('mkdir -p work')
+
+local function write(name, text)
+	local f = assert(io.open('work/' .. name, 'w'))
+	f:write(text)
+	f:close()
+	return 'work/' .. name
+end
+
+local lorem = 'Lorem ipsum dolor sit amet, consectetur adipiscing elit, '
+    .. 'sed do eiusmod tempor incididunt ut labore et dolore magna aliqua.\n'
+
+local cases = {}
+
+-- A large page of literal text with an occasional expression
+do
+	local t = { '<html><body>\n' }
+	for n = 1, 3000 do
+		t[#t + 1] = lorem
+		if n % 30 == 0 then
+			t[#t + 1] = '<p><%= title %></p>\n'
+		end
+	end
+	t[#t + 1] = '</body></html>\n'
+	cases[#cases + 1] = {
+		name = 'literal',
+		file = write('literal.lt', table.concat(t)),
+		data = { title = 'A large literal page' }
+	}
+end
+
+-- A tight loop of expressions
+do
+	local rows = {}
+	for n = 1, 1000 do
+		rows[n] = 'row ' .. n
+	end
+	cases[#cases + 1] = {
+		name = 'loop',
+		file = write('loop.lt', '<table>\n'
+		    .. '<% for i = 1, #rows do %>'
+		    .. '<tr><td><%= i %></td><td><%= rows[i] %></td></tr>\n'
+		    .. '<% end %></table>\n'),
+		data = { rows = rows }
+	}
+end
+
+-- All four escape modes on text that needs escaping
+do
+	local s = {}
+	for n = 1, 200 do
+		s[n] = '<a href="x?a=1&b=' .. n .. '">50% of $10 & {more}</a>'
+	end
+	cases[#cases + 1] = {
+		name = 'escape',
+		file = write('escape.lt', '<% for i = 1, #s do %>'
+		    .. '<%=html s[i] %>\n<%=xml s[i] %>\n'
+		    .. '<%=url s[i] %>\n<%=latex s[i] %>\n<% end %>'),
+		data = { s = s }
+	}
+end
+
+-- A deep extends chain, every level overriding some of many blocks
+do
+	local depth, nblocks = 10, 20
+	local t = { '<html>\n' }
+	for b = 1, nblocks do
+		t[#t + 1] = '<%! block b' .. b .. ' %>base ' .. b
+		    .. ' <%= title %><%! endblock %>\n'
+	end
+	t[#t + 1] = '</html>\n'
+	write('extends0.lt', table.concat(t))
+	for level = 1, depth do
+		t = { '<%! extends work/extends' .. (level - 1) .. '.lt %>\n' }
+		for b = level, nblocks, 2 do
+			t[#t + 1] = '<%! block b' .. b .. ' %>level ' .. level
+			    .. ' <%= title %><%! endblock %>\n'
+		end
+		write('extends' .. level .. '.lt', table.concat(t))
+	end
+	cases[#cases + 1] = {
+		name = 'extends',
+		file = 'work/extends' .. depth .. '.lt',
+		data = { title = 'deep' }
+	}
+end
+
+-- Wide include fan-out
+do
+	local t = {}
+	for n = 1, 100 do
+		write('inc' .. n .. '.lt', '<div>include ' .. n
+		    .. ' <%= title %></div>\n')
+		t[#t + 1] = '<%! include work/inc' .. n .. '.lt %>\n'
+	end
+	cases[#cases + 1] = {
+		name = 'include',
+		file = write('include.lt', table.concat(t)),
+		data = { title = 'fan-out' }
+	}
+	-- The same, with the includes compiled into the template
+	cases[#cases + 1] = {
+		name = 'inlined',
+		file = 'work/include.lt',
+		data = { title = 'fan-out' },
+		inline = true
+	}
+end
+
+-- Calls per second of fn, measured for DURATION seconds of CPU time
+local function measure(fn)
+	local n, start, elapsed = 0, os.clock(), 0
+	repeat
+		for i = 1, 10 do
+			fn()
+		end
+		n = n + 10
+		elapsed = os.clock() - start
+	until elapsed >= DURATION
+	return n / elapsed
+end
+
+local devnull = assert(io.open('/dev/null', 'w'))
+
+local sinks = {
+	{ 'callback', function (ctx, c)
+		ctx:renderFile(c.file, c.data, function () end)
+	end },
+	{ 'fd', function (ctx, c)
+		ctx:renderFile(c.file, c.data, devnull)
+	end },
+	{ 'string', function (ctx, c)
+		ctx:renderToString(c.file, c.data)
+	end },
+	-- Renders BATCH rows per call
+	{ 'batch', function (ctx, c)
+		ctx:renderBatch(c.file, c.rows, devnull)
+	end, BATCH }
+}
+
+print(string.format('%-10s %12s %10s %12s %10s %10s', 'template',
+    'compile ms', 'sink', 'renders/s', 'MB/s', 'alloc B'))
+for _, c in ipairs(cases) do
+	local ctx = template.context()
+	ctx:countAllocs(true)
+	ctx:inline(c.inline)
+	local size = #ctx:renderToString(c.file, c.data)
+	c.rows = {}
+	for n = 1, BATCH do
+		c.rows[n] = c.data
+	end
+	local compile = 0
+	for _, st in pairs(ctx:stats()) do
+		compile = compile + st.compileTime
+	end
+
+	for n, sink in ipairs(sinks) do
+		ctx:resetStats()
+		local rate = measure(function ()
+			sink[2](ctx, c)
+		end) * (sink[3] or 1)
+		-- Lua heap allocated per render of the template itself
+		local st = ctx:stats()[c.file]
+		print(string.format('%-10s %12s %10s %12.0f %10.1f %10.0f',
+		    n == 1 and c.name or '',
+		    n == 1 and string.format('%.2f', compile * 1000) or '',
+		    sink[1], rate, rate * size / 1e6,
+		    st.allocBytes / st.renders))
+	end
+end
+devnull:close()
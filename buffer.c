@@ -21,49 +21,90 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "buffer.h"
 
+/*
+ * Appends return -1 when memory is exhausted.  The error is sticky, later
+ * appends fail as well, so that callers can check once when done.
+ */
+
 int
 buf_init(struct buffer *b)
 {
-        if ((b->data = malloc(BUFFER_SIZE)) == NULL)
+        b->size = 0;
+        b->error = 0;
+        if ((b->data = malloc(BUFFER_SIZE)) == NULL) {
+                b->capacity = 0;
+                b->error = 1;
                 return -1;
+        }
         b->capacity = BUFFER_SIZE;
-        b->size = 0;
+        return 0;
 }
 
-static void
-buf_resize(struct buffer *b, size_t size)
+/* Make room for at least len more bytes, doubling the capacity */
+int
+buf_reserve(struct buffer *b, size_t len)
 {
-        size_t enlargement = BUFFER_SIZE;
+        size_t capacity;
+        char *data;
+
+        if (b->error)
+                return -1;
+        if (b->size + len <= b->capacity)
+                return 0;
+        if (b->size + len < b->size)
+                goto fail;
 
-        while (enlargement < size)
-                enlargement += BUFFER_SIZE;
-        b->capacity += enlargement;
-        b->data = realloc(b->data, b->capacity);
+        capacity = b->capacity > 0 ? b->capacity : BUFFER_SIZE;
+        while (capacity < b->size + len) {
+                if (capacity > SIZE_MAX / 2) {
+                        capacity = b->size + len;
+                        break;
+                }
+                capacity *= 2;
+        }
+        if ((data = realloc(b->data, capacity)) == NULL)
+                goto fail;
+        b->data = data;
+        b->capacity = capacity;
+        return 0;
+fail:
+        b->error = 1;
+        return -1;
 }
 
-void
+int
 buf_addstring(struct buffer *b, const char *s)
 {
-        size_t len;
+        return buf_addlstring(b, s, strlen(s));
+}
 
-        len = strlen(s);
-        if (b->size  + len > b->capacity)
-                buf_resize(b, len);
-        strcpy(b->data + b->size, s);
+int
+buf_addlstring(struct buffer *b, const char *s, size_t len)
+{
+        if (b->error)
+                return -1;
+        if (b->size + len > b->capacity && buf_reserve(b, len))
+                return -1;
+        memcpy(b->data + b->size, s, len);
         b->size += len;
+        return 0;
 }
 
-void
+int
 buf_addchar(struct buffer *b, char c)
 {
-        if (b->size + 1 > b->capacity)
-                buf_resize(b,  1);
-        *(b->data + b->size++) = c;
+        if (b->error)
+                return -1;
+        if (b->size == b->capacity && buf_reserve(b, 1))
+                return -1;
+        b->data[b->size++] = c;
+        return 0;
 }
 
 void
@@ -32,11 +32,14 @@ struct buffer {
         char    *data;
         size_t   capacity;
         size_t   size;
+        int      error;         /* an allocation failed */
 };
 
 extern int buf_init(struct buffer *);
-extern void buf_addstring(struct buffer *, const char *);
-extern void buf_addchar(struct buffer *, char);
+extern int buf_reserve(struct buffer *, size_t);
+extern int buf_addstring(struct buffer *, const char *);
+extern int buf_addlstring(struct buffer *, const char *, size_t);
+extern int buf_addchar(struct buffer *, char);
 extern void buf_push(struct buffer *, lua_State *);
 extern void buf_free(struct buffer *);
 
@@ -0,0 +1,453 @@
+/*
+ * Copyright (C) 2021 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Serialization of compiled templates and the on-disk bytecode cache */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "buffer.h"
+#include "luatemplate.h"
+
+#define CACHE_MAGIC	"LTC\002"
+#define CACHE_SUFFIX	".ltc"
+
+static int
+writer(lua_State *L __attribute__((unused)), const void *p, size_t sz,
+    void *ud)
+{
+	return buf_addlstring(ud, p, sz);
+}
+
+static void
+put_size(struct buffer *b, uint64_t v)
+{
+	buf_addlstring(b, (const char *)&v, sizeof v);
+}
+
+static void
+put_string(struct buffer *b, const char *s, size_t len)
+{
+	put_size(b, len);
+	buf_addlstring(b, s, len);
+}
+
+static int
+get_size(const char **p, const char *end, uint64_t *v)
+{
+	if ((size_t)(end - *p) < sizeof *v)
+		return -1;
+	memcpy(v, *p, sizeof *v);
+	*p += sizeof *v;
+	return 0;
+}
+
+static const char *
+get_string(const char **p, const char *end, size_t *len)
+{
+	const char *s;
+	uint64_t v;
+
+	if (get_size(p, end, &v) || (uint64_t)(end - *p) < v)
+		return NULL;
+	s = *p;
+	*p += v;
+	*len = v;
+	return s;
+}
+
+/*
+ * Append the include list, with the files of inlined templates, and the
+ * compiled template, which must be on top of the stack, to b.
+ */
+int
+lt_dump(lua_State *L, struct buffer *b, struct lt_include_head *includes)
+{
+	struct lt_include *include;
+	uint64_t n;
+	size_t mark;
+
+	put_size(b, includes->count);
+	SLIST_FOREACH(include, &includes->list, next) {
+		put_string(b, include->fnam, strlen(include->fnam) + 1);
+		put_size(b, (uint64_t)include->mtime);
+		put_size(b, (uint64_t)include->size);
+	}
+
+	mark = b->size;
+	put_size(b, 0);
+	lua_pushvalue(L, -1);
+#if LUA_VERSION_NUM >= 503
+	if (lua_dump(L, writer, b, 0)) {
+#else
+	if (lua_dump(L, writer, b)) {
+#endif
+		lua_pop(L, 1);
+		return -1;
+	}
+	lua_pop(L, 1);
+	n = b->size - mark - sizeof n;
+	memcpy(b->data + mark, &n, sizeof n);
+	return 0;
+}
+
+/*
+ * Read what lt_dump() wrote, advancing *p.  The compiled template is
+ * pushed and the include list is filled in.  Nothing is pushed if the
+ * data is not usable.
+ */
+int
+lt_undump(lua_State *L, const char **p, const char *end,
+    struct lt_include_head *includes)
+{
+	struct lt_include *include;
+	const char *s;
+	uint64_t n, mtime, size;
+	size_t len;
+
+	if (get_size(p, end, &n))
+		return -1;
+	while (n--) {
+		if ((s = get_string(p, end, &len)) == NULL || len == 0
+		    || s[len - 1] != '\0' || get_size(p, end, &mtime)
+		    || get_size(p, end, &size))
+			goto fail;
+		if ((include = lt_add_include(includes, s)) == NULL)
+			goto fail;
+		include->mtime = (int64_t)mtime;
+		include->size = (int64_t)size;
+	}
+
+	if ((s = get_string(p, end, &len)) == NULL)
+		goto fail;
+	if (luaL_loadbufferx(L, s, len, "template", "b") == LUA_OK)
+		return 0;
+
+	/* Remove the error message */
+	lua_pop(L, 1);
+fail:
+	lt_free_includes(includes);
+	return -1;
+}
+
+/* FNV-1a hash of len bytes at s */
+uint64_t
+lt_hash(const char *s, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	for (; len > 0; s++, len--) {
+		h ^= (unsigned char)*s;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/* Hash of the search roots, 0 for the default ones */
+uint64_t
+lt_roots_hash(char **roots)
+{
+	uint64_t h;
+
+	if (roots == NULL)
+		return 0;
+	for (h = lt_hash("", 1); *roots != NULL; roots++)
+		h = (h ^ lt_hash(*roots, strlen(*roots) + 1))
+		    * 0x100000001b3ULL;
+	return h;
+}
+
+/*
+ * Hash of what compiled code depends on besides the file: its path, the
+ * name the template was found under, which the code uses to refer to
+ * itself, the search roots, which decide what is inlined, and the compile
+ * options.
+ */
+uint64_t
+lt_code_key(const char *path, const char *fnam, char **roots, int options)
+{
+	uint64_t h;
+
+	h = lt_hash(path, strlen(path) + 1);
+	h = (h ^ lt_hash(fnam, strlen(fnam) + 1)) * 0x100000001b3ULL;
+	h = (h ^ lt_roots_hash(roots)) * 0x100000001b3ULL;
+	return (h ^ (uint64_t)options) * 0x100000001b3ULL;
+}
+
+/*
+ * The cache file name is the code key, so that contexts with different
+ * options or search roots can share a cache.  Returns -1 if the name does
+ * not fit.
+ */
+static int
+cache_path(char *cpath, size_t len, const char *dir, const char *path,
+    const char *fnam, char **roots, int options)
+{
+	int n;
+
+	n = snprintf(cpath, len, "%s/%016llx" CACHE_SUFFIX, dir,
+	    (unsigned long long)lt_code_key(path, fnam, roots, options));
+	return n < 0 || (size_t)n >= len ? -1 : 0;
+}
+
+static void
+put_header(struct buffer *b, const char *path, const char *fnam,
+    char **roots, struct stat *sb, int options)
+{
+	buf_addlstring(b, CACHE_MAGIC, sizeof CACHE_MAGIC - 1);
+	put_string(b, LT_VERSION, sizeof LT_VERSION - 1);
+	put_size(b, LT_CODE_VERSION);
+	put_size(b, (uint64_t)options);
+	put_size(b, (uint64_t)sb->st_mtime);
+	put_size(b, (uint64_t)sb->st_size);
+	put_string(b, path, strlen(path));
+	put_string(b, fnam, strlen(fnam));
+	put_size(b, lt_roots_hash(roots));
+}
+
+/*
+ * A cache file is only valid for the same template path, name, search
+ * roots, modification time, size, compile options, luatemplate version
+ * and version of the generated code.
+ */
+static int
+check_header(const char **p, const char *end, const char *path,
+    const char *fnam, char **roots, struct stat *sb, int options)
+{
+	const char *s;
+	uint64_t v;
+	size_t len;
+
+	if ((size_t)(end - *p) < sizeof CACHE_MAGIC - 1
+	    || memcmp(*p, CACHE_MAGIC, sizeof CACHE_MAGIC - 1))
+		return -1;
+	*p += sizeof CACHE_MAGIC - 1;
+
+	if ((s = get_string(p, end, &len)) == NULL
+	    || len != sizeof LT_VERSION - 1 || memcmp(s, LT_VERSION, len))
+		return -1;
+	if (get_size(p, end, &v) || v != LT_CODE_VERSION)
+		return -1;
+	if (get_size(p, end, &v) || v != (uint64_t)options)
+		return -1;
+	if (get_size(p, end, &v) || v != (uint64_t)sb->st_mtime)
+		return -1;
+	if (get_size(p, end, &v) || v != (uint64_t)sb->st_size)
+		return -1;
+	if ((s = get_string(p, end, &len)) == NULL || len != strlen(path)
+	    || memcmp(s, path, len))
+		return -1;
+	if ((s = get_string(p, end, &len)) == NULL || len != strlen(fnam)
+	    || memcmp(s, fnam, len))
+		return -1;
+	if (get_size(p, end, &v) || v != lt_roots_hash(roots))
+		return -1;
+	return 0;
+}
+
+/*
+ * Push the compiled template of path, found as fnam in roots, from the
+ * cache.  Returns -1 if there is no valid cache entry.
+ */
+int
+cache_load(lua_State *L, const char *dir, const char *path,
+    const char *fnam, char **roots, struct stat *sb,
+    struct lt_include_head *includes, int options)
+{
+	struct stat cb;
+	char cpath[PATH_MAX];
+	const char *p;
+	char *map;
+	int fd, rv;
+
+	if (cache_path(cpath, sizeof cpath, dir, path, fnam, roots, options)
+	    || (fd = open(cpath, O_RDONLY)) == -1)
+		return -1;
+	if (fstat(fd, &cb) || cb.st_size == 0 || (map = mmap(0, cb.st_size,
+	    PROT_READ, MAP_PRIVATE | MAP_FILE, fd, (off_t)0L)) == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+
+	p = map;
+	rv = -1;
+	if (!check_header(&p, map + cb.st_size, path, fnam, roots, sb,
+	    options))
+		rv = lt_undump(L, &p, map + cb.st_size, includes);
+
+	munmap(map, cb.st_size);
+	close(fd);
+	return rv;
+}
+
+/*
+ * Save the compiled template on top of the stack.  The file is written
+ * under a temporary name and then renamed, so concurrent readers never
+ * see partial data.  Errors are ignored, the cache is only an
+ * optimization.
+ */
+void
+cache_store(lua_State *L, const char *dir, const char *path,
+    const char *fnam, char **roots, struct stat *sb,
+    struct lt_include_head *includes, int options)
+{
+	struct buffer b;
+	char cpath[PATH_MAX], tmp[PATH_MAX];
+	const char *p;
+	ssize_t n;
+	size_t len;
+	int fd;
+
+	if (buf_init(&b))
+		return;
+	put_header(&b, path, fnam, roots, sb, options);
+	if (lt_dump(L, &b, includes) || b.error)
+		goto out;
+
+	if (cache_path(cpath, sizeof cpath, dir, path, fnam, roots, options))
+		goto out;
+	n = snprintf(tmp, sizeof tmp, "%s.XXXXXX", cpath);
+	if (n < 0 || (size_t)n >= sizeof tmp || (fd = mkstemp(tmp)) == -1)
+		goto out;
+
+	for (p = b.data, len = b.size; len > 0; p += n, len -= n)
+		if ((n = write(fd, p, len)) <= 0)
+			break;
+	if (close(fd) || len > 0 || rename(tmp, cpath))
+		unlink(tmp);
+out:
+	buf_free(&b);
+}
+
+/*
+ * A bundle holds any number of compiled templates, written by the ltc
+ * compiler, so that a production host never has to parse templates.
+ */
+#define BUNDLE_MAGIC	"LTB\001"
+
+void
+bundle_init(struct buffer *b)
+{
+	buf_addlstring(b, BUNDLE_MAGIC, sizeof BUNDLE_MAGIC - 1);
+	put_string(b, LT_VERSION, sizeof LT_VERSION - 1);
+	put_size(b, LT_CODE_VERSION);
+}
+
+/* Append the compiled template fnam, which is on top of the stack */
+int
+bundle_add(lua_State *L, struct buffer *b, const char *fnam,
+    struct stat *sb, struct lt_include_head *includes)
+{
+	put_string(b, fnam, strlen(fnam) + 1);
+	put_size(b, (uint64_t)sb->st_mtime);
+	put_size(b, (uint64_t)sb->st_size);
+	return lt_dump(L, b, includes);
+}
+
+/*
+ * Install all templates of a bundle in the template table of the
+ * container at index container.  The bundle is mapped and read in one
+ * go.  Templates from a bundle are marked as such and never checked
+ * against the file system.  Templates they replace are evicted first,
+ * which also drops the dispatch tables of their extends chains.
+ */
+int
+bundle_load(lua_State *L, int container, const char *file)
+{
+	struct lt_include_head includes;
+	struct stat sb;
+	const char *p, *end, *fnam;
+	char *map;
+	uint64_t mtime, size;
+	size_t len;
+	int fd, rv;
+
+	if ((fd = open(file, O_RDONLY)) == -1) {
+		lua_pushfstring(L, "can't open %s", file);
+		return -1;
+	}
+	if (fstat(fd, &sb) || (map = mmap(0, sb.st_size, PROT_READ,
+	    MAP_PRIVATE | MAP_FILE, fd, (off_t)0L)) == MAP_FAILED) {
+		lua_pushfstring(L, "can't mmap %s", file);
+		close(fd);
+		return -1;
+	}
+
+	p = map;
+	end = map + sb.st_size;
+	rv = -1;
+	if ((size_t)(end - p) < sizeof BUNDLE_MAGIC - 1
+	    || memcmp(p, BUNDLE_MAGIC, sizeof BUNDLE_MAGIC - 1)) {
+		lua_pushfstring(L, "%s is not a template bundle", file);
+		goto out;
+	}
+	p += sizeof BUNDLE_MAGIC - 1;
+	if ((fnam = get_string(&p, end, &len)) == NULL
+	    || len != sizeof LT_VERSION - 1 || memcmp(fnam, LT_VERSION, len)
+	    || get_size(&p, end, &size) || size != LT_CODE_VERSION) {
+		lua_pushfstring(L, "%s was built for a different version",
+		    file);
+		goto out;
+	}
+
+	lt_init_includes(&includes);
+	while (p < end) {
+		if ((fnam = get_string(&p, end, &len)) == NULL || len == 0
+		    || fnam[len - 1] != '\0' || get_size(&p, end, &mtime)
+		    || get_size(&p, end, &size)
+		    || lt_undump(L, &p, end, &includes)) {
+			lua_pushfstring(L, "%s is corrupt", file);
+			goto out;
+		}
+		lt_free_includes(&includes);
+		lt_evict(L, container, fnam);
+		if (lt_run(L, container))
+			goto out;
+
+		lua_getfield(L, container, "template");
+		lua_getfield(L, -1, fnam);
+		lua_pushboolean(L, 1);
+		lua_setfield(L, -2, "bundled");
+		lua_pushinteger(L, (lua_Integer)mtime);
+		lua_setfield(L, -2, "mtime");
+		lua_pop(L, 2);
+	}
+	rv = 0;
+out:
+	munmap(map, sb.st_size);
+	close(fd);
+	return rv;
+}
@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2021 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Native formatters.  The reader compiles expressions with a single
+ * simple conversion, like <%=%5d n %> or <%=%.2f x %>, to calls of these
+ * functions, which format the value straight into the sink instead of
+ * going through string.format() and print().  The field width comes
+ * first, for format_f() followed by the precision, then the value.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "buffer.h"
+#include "luatemplate.h"
+
+/* Large enough for %99.99f of the largest double */
+#define FORMAT_SIZE	512
+
+/* The render state of the coroutine, the context is the upvalue */
+static struct lt_render *
+render(lua_State *L)
+{
+	return lt_render(L, lua_touserdata(L, lua_upvalueindex(1)));
+}
+
+static void
+put(lua_State *L, const char *s, int len)
+{
+	sink_write(L, render(L), s, len);
+}
+
+/* Pass the output on at the end of a formatter, this may yield */
+static int
+done(lua_State *L)
+{
+	return sink_poll(L, render(L), 0);
+}
+
+static int
+format_d(lua_State *L)
+{
+	char s[FORMAT_SIZE];
+
+	put(L, s, snprintf(s, sizeof s, "%*" LUA_INTEGER_FRMLEN "d",
+	    (int)luaL_checkinteger(L, 1), (LUAI_UACINT)luaL_checkinteger(L, 2)));
+	return done(L);
+}
+
+static int
+format_x(lua_State *L)
+{
+	char s[FORMAT_SIZE];
+
+	put(L, s, snprintf(s, sizeof s, "%*" LUA_INTEGER_FRMLEN "x",
+	    (int)luaL_checkinteger(L, 1), (LUAI_UACINT)luaL_checkinteger(L, 2)));
+	return done(L);
+}
+
+static int
+format_f(lua_State *L)
+{
+	char s[FORMAT_SIZE];
+
+	put(L, s, snprintf(s, sizeof s, "%*.*" LUA_NUMBER_FRMLEN "f",
+	    (int)luaL_checkinteger(L, 1), (int)luaL_checkinteger(L, 2),
+	    (LUAI_UACNUMBER)luaL_checknumber(L, 3)));
+	return done(L);
+}
+
+/* Strings are right aligned in their field, like %Ns does */
+static int
+format_s(lua_State *L)
+{
+	static const char spaces[] = "                                "
+	    "                                                                   ";
+	const char *s;
+	size_t len, width;
+
+	width = luaL_checkinteger(L, 1);
+	s = luaL_tolstring(L, 2, &len);
+	if (width > sizeof spaces - 1)
+		width = sizeof spaces - 1;
+	if (len < width)
+		put(L, spaces, width - len);
+	put(L, s, len);
+	return done(L);
+}
+
+/* Add the formatters to the table on top of the stack, ctx is below it */
+void
+lt_formatters(lua_State *L)
+{
+	struct luaL_Reg formatters[] = {
+		{ "format_d",	format_d },
+		{ "format_x",	format_x },
+		{ "format_f",	format_f },
+		{ "format_s",	format_s },
+		{ NULL, NULL }
+	};
+
+	lua_pushvalue(L, -2);
+	luaL_setfuncs(L, formatters, 1);
+}
+
+/*
+ * Check whether the format spec of len bytes is a single conversion the
+ * formatters above handle: %d, %x, %s and %f with an optional width of up
+ * to two digits, %f also with an optional precision.  Return the
+ * conversion character or 0 to fall back to string.format().
+ */
+int
+lt_native_format(const char *spec, size_t len, int *width, int *prec)
+{
+	const char *p, *pe;
+	int n;
+
+	p = spec + 1;
+	pe = spec + len;
+	*width = 0;
+	*prec = -1;
+	for (n = 0; p < pe && n < 3 && *p >= '0' && *p <= '9'; n++, p++)
+		*width = *width * 10 + *p - '0';
+	if (n > 2 || (n > 0 && spec[1] == '0'))
+		return 0;
+	if (p < pe && *p == '.') {
+		*prec = 0;
+		for (n = 0, p++; p < pe && n < 3 && *p >= '0' && *p <= '9';
+		    n++, p++)
+			*prec = *prec * 10 + *p - '0';
+		if (n > 2)
+			return 0;
+	}
+	if (p + 1 != pe)
+		return 0;
+	switch (*p) {
+	case 'f':
+		return 'f';
+	case 'd':
+	case 'x':
+	case 's':
+		return *prec == -1 ? *p : 0;
+	}
+	return 0;
+}
@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2021 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Fragment caching.  The region between <%! cache key ttl %> and
+ * <%! endcache %> calls cache_begin() and cache_end().  While a region is
+ * captured, its output stays in the output buffer, and at its end it is
+ * copied to the fragment table of the container, from where cache_begin()
+ * replays it until the TTL expires.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include <stdint.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "buffer.h"
+#include "luatemplate.h"
+
+/*
+ * The fragments are listed by recent use, from the newest to the oldest
+ * field of the fragment table, like templates are, see lt_touch().  The
+ * keys of fragments start with the escape mode, so they can't clash.
+ */
+
+/* Take the fragment at index f off the list of the table at frags */
+static void
+unlink_fragment(lua_State *L, int frags, int f)
+{
+	lua_getfield(L, f, "newer");
+	lua_getfield(L, f, "older");
+	lua_pushvalue(L, -1);
+	if (lua_isnil(L, -3))
+		lua_setfield(L, frags, "newest");
+	else
+		lua_setfield(L, -3, "older");
+	lua_pushvalue(L, -2);
+	if (lua_isnil(L, -2))
+		lua_setfield(L, frags, "oldest");
+	else
+		lua_setfield(L, -2, "newer");
+	lua_pop(L, 2);
+}
+
+/* Put the fragment at index f at the front of the list */
+static void
+link_fragment(lua_State *L, int frags, int f)
+{
+	lua_pushnil(L);
+	lua_setfield(L, f, "newer");
+	if (lua_getfield(L, frags, "newest") == LUA_TNIL) {
+		lua_pushvalue(L, f);
+		lua_setfield(L, frags, "oldest");
+	} else {
+		lua_pushvalue(L, f);
+		lua_setfield(L, -2, "newer");
+	}
+	lua_setfield(L, f, "older");
+	lua_pushvalue(L, f);
+	lua_setfield(L, frags, "newest");
+}
+
+/* Remove fragment key, which must be on top of the stack, from frags */
+static void
+drop(lua_State *L, struct render_context *ctx, int frags)
+{
+	lua_pushvalue(L, -1);
+	if (lua_rawget(L, frags) == LUA_TTABLE) {
+		lua_getfield(L, -1, "size");
+		ctx->fragbytes -= lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		unlink_fragment(L, frags, lua_gettop(L));
+	}
+	lua_pop(L, 1);
+	lua_pushnil(L);
+	lua_rawset(L, frags);
+}
+
+/*
+ * Make room for size more bytes, removing the least recently used
+ * fragments.  Expired ones are removed when they are looked up.
+ */
+static void
+trim(lua_State *L, struct render_context *ctx, int frags, lua_Integer size)
+{
+	while (ctx->fragbytes + size > ctx->maxfragbytes) {
+		if (lua_getfield(L, frags, "oldest") != LUA_TTABLE) {
+			lua_pop(L, 1);
+			break;
+		}
+		lua_getfield(L, -1, "key");
+		lua_remove(L, -2);
+		drop(L, ctx, frags);
+	}
+}
+
+/*
+ * cache_begin(key, ttl, escape) replays the fragment cached under key and
+ * returns false, or starts capturing the output and returns true.  The
+ * escape mode of the region is part of the key.
+ */
+int
+fragment_begin(lua_State *L)
+{
+	struct render_context *ctx;
+	struct lt_render *r;
+	struct lt_capture *cap;
+	const char *s;
+	size_t len;
+	lua_Number ttl;
+	int frags;
+
+	ctx = lua_touserdata(L, lua_upvalueindex(1));
+	r = lt_render(L, ctx);
+	luaL_checkstring(L, 1);
+	ttl = luaL_checknumber(L, 2);
+	lua_settop(L, 3);
+	lua_pushfstring(L, "%d:", (int)lua_tointeger(L, 3));
+	lua_pushvalue(L, 1);
+	lua_concat(L, 2);
+
+	lua_getuservalue(L, lua_upvalueindex(1));
+	lua_getfield(L, -1, "fragments");
+	frags = lua_gettop(L);
+	lua_pushvalue(L, 4);
+	if (lua_rawget(L, frags) == LUA_TTABLE) {
+		lua_getfield(L, -1, "expires");
+		if (lt_msec() < lua_tointeger(L, -1)) {
+			unlink_fragment(L, frags, frags + 1);
+			link_fragment(L, frags, frags + 1);
+			lua_getfield(L, -2, "s");
+			s = lua_tolstring(L, -1, &len);
+			ctx->fraghits++;
+			sink_write(L, r, s, len);
+			lua_pushboolean(L, 0);
+			return sink_poll(L, r, 1);
+		}
+		lua_pushvalue(L, 4);
+		drop(L, ctx, frags);
+	}
+	ctx->fragmisses++;
+
+	if (r->ncapture == LT_MAXCAPTURE)
+		return luaL_error(L, "fragment caches nested too deeply");
+	cap = &r->capture[r->ncapture];
+	lua_pushvalue(L, 4);
+	cap->key = luaL_ref(L, LUA_REGISTRYINDEX);
+	cap->ttl = ttl * 1000;
+	cap->start = r->out.size;
+	cap->depth = r->depth;
+	r->ncapture++;
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/* cache_end() stores the output captured since the matching cache_begin() */
+int
+fragment_end(lua_State *L)
+{
+	struct render_context *ctx;
+	struct lt_render *r;
+	struct lt_capture *cap;
+	lua_Integer now, size;
+	int frags;
+
+	ctx = lua_touserdata(L, lua_upvalueindex(1));
+	r = lt_render(L, ctx);
+	if (r->ncapture == 0 || r->capture[r->ncapture - 1].depth != r->depth)
+		return luaL_error(L, "cache_end() without cache_begin()");
+	cap = &r->capture[--r->ncapture];
+	size = (lua_Integer)(r->out.size - cap->start);
+
+	lua_settop(L, 0);
+	lua_getuservalue(L, lua_upvalueindex(1));
+	lua_getfield(L, 1, "fragments");
+	frags = 2;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, cap->key);
+	luaL_unref(L, LUA_REGISTRYINDEX, cap->key);
+
+	lua_pushvalue(L, 3);
+	drop(L, ctx, frags);
+	if (size <= ctx->maxfragbytes) {
+		now = lt_msec();
+		trim(L, ctx, frags, size);
+		lua_pushvalue(L, 3);
+		lua_createtable(L, 0, 6);
+		lua_pushlstring(L, r->out.data + cap->start, size);
+		lua_setfield(L, -2, "s");
+		lua_pushinteger(L, now + cap->ttl);
+		lua_setfield(L, -2, "expires");
+		lua_pushinteger(L, size);
+		lua_setfield(L, -2, "size");
+		lua_pushvalue(L, 3);
+		lua_setfield(L, -2, "key");
+		link_fragment(L, frags, lua_gettop(L));
+		lua_rawset(L, frags);
+		ctx->fragbytes += size;
+	}
+	return sink_poll(L, r, 0);
+}
+
+/* Forget the captures interrupted by an error in a render at depth */
+void
+fragment_unwind(lua_State *L, struct lt_render *r, int depth)
+{
+	while (r->ncapture > 0 && r->capture[r->ncapture - 1].depth >= depth)
+		luaL_unref(L, LUA_REGISTRYINDEX, r->capture[--r->ncapture].key);
+}
+
+/* Remove all cached fragments from the container at index container */
+void
+fragment_flush(lua_State *L, struct render_context *ctx, int container)
+{
+	lua_newtable(L);
+	lua_setfield(L, container, "fragments");
+	ctx->fragbytes = 0;
+}
@@ -0,0 +1,320 @@
+/*
+ * Copyright (C) 2021 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Ahead-of-time template compiler: compile templates and everything they
+ * include or extend into a bundle that can be loaded with loadBundle().
+ * With -c, a single template is written as the C source of a native
+ * module instead, see native.c.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <fts.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "buffer.h"
+#include "luatemplate.h"
+
+static struct lt_include_head done;
+static int flags;
+static int native;
+static int verbose;
+
+/*
+ * Compile template fnam, looked up in roots, and everything it includes or
+ * extends into the bundle b.
+ */
+static int
+compile(lua_State *L, struct buffer *b, const char *fnam, char **roots)
+{
+	struct lt_include_head includes;
+	struct lt_include *include;
+	struct lt_state s;
+	struct stat sb;
+	char path[PATH_MAX];
+	int rv;
+
+	if (lt_find_include(&done, fnam) != NULL)
+		return 0;
+	lt_add_include(&done, fnam);
+
+	if (lt_resolve(roots, fnam, path, sizeof path, &sb)) {
+		warnx("can't stat %s", fnam);
+		return -1;
+	}
+	if (verbose)
+		printf("compiling %s\n", path);
+
+	lt_init_includes(&includes);
+	rv = -1;
+	if (lt_compile(L, fnam, path, &sb, &s, &includes, roots, flags)) {
+		warnx("%s: %s", fnam, lua_tostring(L, -1));
+		lua_pop(L, 1);
+		goto out;
+	}
+	if (bundle_add(L, b, fnam, &sb, &includes)) {
+		warnx("%s: can't dump", fnam);
+		lua_pop(L, 1);
+		goto out;
+	}
+	lua_pop(L, 1);
+
+	rv = 0;
+	SLIST_FOREACH(include, &includes.list, next)
+		if (compile(L, b, include->fnam, roots))
+			rv = -1;
+out:
+	lt_free_includes(&includes);
+	return rv;
+}
+
+/* Write len bytes at p as the body of a C array initializer */
+static void
+write_bytes(FILE *fp, const char *p, size_t len)
+{
+	size_t n;
+
+	for (n = 0; n < len; n++)
+		fprintf(fp, "%s0x%02x,", n % 12 ? " " : "\n\t",
+		    (unsigned char)p[n]);
+	/* Arrays can't be empty */
+	fprintf(fp, "%s0x00\n", n % 12 ? " " : "\n\t");
+}
+
+/* Write the C source of the native module for template fnam to fp */
+static int
+compile_native(lua_State *L, FILE *fp, const char *fnam)
+{
+	struct lt_include_head includes;
+	struct lt_state s;
+	struct buffer code, text;
+	struct stat sb;
+	char path[PATH_MAX];
+	int rv;
+
+	if (lt_resolve(NULL, fnam, path, sizeof path, &sb)) {
+		warnx("can't stat %s", fnam);
+		return -1;
+	}
+	if (verbose)
+		printf("compiling %s\n", path);
+
+	lt_init_includes(&includes);
+	if (buf_init(&code) || buf_init(&text))
+		errx(1, "memory error");
+	s.literals = &text;
+	rv = -1;
+	if (lt_compile(L, fnam, path, &sb, &s, &includes, NULL,
+	    flags | LT_NATIVE)) {
+		warnx("%s: %s", fnam, lua_tostring(L, -1));
+		lua_pop(L, 1);
+		goto out;
+	}
+	if (lt_dump(L, &code, &includes) || code.error || text.error) {
+		warnx("%s: can't dump", fnam);
+		lua_pop(L, 1);
+		goto out;
+	}
+	lua_pop(L, 1);
+
+	fprintf(fp, "/* Native module of %s, generated by ltc */\n\n"
+	    "#include <stddef.h>\n\n"
+	    "struct lt_native {\n"
+	    "\tint\t\t version;\n"
+	    "\tint\t\t options;\n"
+	    "\tconst char\t*fnam;\n"
+	    "\tlong long\t mtime;\n"
+	    "\tlong long\t size;\n"
+	    "\tconst char\t*code;\n"
+	    "\tsize_t\t\t codelen;\n"
+	    "\tconst char\t*text;\n"
+	    "\tsize_t\t\t textlen;\n"
+	    "};\n\n", fnam);
+	fprintf(fp, "static const char code[] = {");
+	write_bytes(fp, code.data, code.size);
+	fprintf(fp, "};\n\nstatic const char text[] = {");
+	write_bytes(fp, text.data, text.size);
+	fprintf(fp, "};\n\nconst struct lt_native %s = {\n"
+	    "\t%d, %d, \"%s\", %lldLL, %lldLL,\n"
+	    "\tcode, %zu, text, %zu\n};\n", LT_NATIVE_SYMBOL,
+	    LT_CODE_VERSION, LT_OPTIONS(flags), fnam,
+	    (long long)sb.st_mtime, (long long)sb.st_size,
+	    code.size, text.size);
+	rv = 0;
+out:
+	buf_free(&code);
+	buf_free(&text);
+	lt_free_includes(&includes);
+	return rv;
+}
+
+/*
+ * Compile all .lt files below a directory.  The directory is the search
+ * root, like with ctx:searchPath(dir): templates are named relative to it
+ * and so are the templates they include.
+ */
+static int
+compile_tree(lua_State *L, struct buffer *b, char *dir)
+{
+	FTS *fts;
+	FTSENT *e;
+	char *argv[2], *roots[2];
+	const char *fnam;
+	size_t len;
+	int rv;
+
+	roots[0] = dir;
+	roots[1] = NULL;
+	argv[0] = dir;
+	argv[1] = NULL;
+	if ((fts = fts_open(argv, FTS_PHYSICAL, NULL)) == NULL) {
+		warn("%s", dir);
+		return -1;
+	}
+	rv = 0;
+	while ((e = fts_read(fts)) != NULL) {
+		if (e->fts_info != FTS_F)
+			continue;
+		len = strlen(e->fts_path);
+		if (len < 3 || strcmp(e->fts_path + len - 3, ".lt"))
+			continue;
+		fnam = e->fts_path + strlen(dir);
+		while (*fnam == '/')
+			fnam++;
+		if (compile(L, b, fnam, roots))
+			rv = -1;
+	}
+	fts_close(fts);
+	return rv;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: ltc [-imv] -o bundle template|directory ...\n"
+	    "       ltc -c [-imv] -o source template\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct buffer b;
+	struct stat sb;
+	lua_State *L;
+	const char *output, *p;
+	FILE *fp;
+	char tmp[PATH_MAX];
+	ssize_t n;
+	size_t len;
+	int c, fd, rv;
+
+	output = NULL;
+	while ((c = getopt(argc, argv, "cimo:v")) != -1) {
+		switch (c) {
+		case 'c':
+			native = 1;
+			break;
+		case 'i':
+			flags |= LT_INLINE;
+			break;
+		case 'm':
+			flags |= LT_MINIFY;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (output == NULL || argc == 0 || (native && argc != 1))
+		usage();
+
+	if ((L = luaL_newstate()) == NULL)
+		errx(1, "can't create Lua state");
+
+	if (native) {
+		snprintf(tmp, sizeof tmp, "%s.XXXXXX", output);
+		if ((fd = mkstemp(tmp)) == -1 || (fp = fdopen(fd, "w")) == NULL)
+			err(1, "%s", tmp);
+		if (compile_native(L, fp, *argv)) {
+			fclose(fp);
+			unlink(tmp);
+			errx(1, "compilation failed, %s not written", output);
+		}
+		if (fchmod(fd, 0644) || fclose(fp) || rename(tmp, output))
+			err(1, "%s", output);
+		lua_close(L);
+		return 0;
+	}
+	if (buf_init(&b))
+		errx(1, "memory error");
+	bundle_init(&b);
+
+	rv = 0;
+	for (; argc > 0; argc--, argv++) {
+		if (!stat(*argv, &sb) && S_ISDIR(sb.st_mode))
+			c = compile_tree(L, &b, *argv);
+		else
+			c = compile(L, &b, *argv, NULL);
+		if (c)
+			rv = 1;
+	}
+	if (rv)
+		errx(1, "compilation failed, %s not written", output);
+	if (b.error)
+		errx(1, "memory error");
+
+	snprintf(tmp, sizeof tmp, "%s.XXXXXX", output);
+	if ((fd = mkstemp(tmp)) == -1)
+		err(1, "%s", tmp);
+	for (p = b.data, len = b.size; len > 0; p += n, len -= n)
+		if ((n = write(fd, p, len)) <= 0)
+			err(1, "%s", tmp);
+	if (fchmod(fd, 0644) || close(fd) || rename(tmp, output))
+		err(1, "%s", output);
+
+	buf_free(&b);
+	lt_free_includes(&done);
+	lua_close(L);
+	return 0;
+}
@@ -28,217 +28,1699 @@
 #include <sys/queue.h>
 
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <err.h>
+#include <unistd.h>
 
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
 
+#include "buffer.h"
 #include "luatemplate.h"
 
+/*
+ * Return the escaped string.  Templates print escaped values with
+ * print_html() and the like, which write to the sink without a string.
+ */
+static int
+escape(lua_State *L, int escape)
+{
+	luaL_Buffer b;
+	const struct lt_entity *esc, *e;
+	const char *s;
+	size_t len, n;
+
+	s = luaL_checklstring(L, -1, &len);
+	esc = lt_escape_table(escape);
+
+	/* Strings that need no escaping are returned as they are */
+	if (esc == NULL || (n = lt_escape_span(esc, s, len)) == len)
+		return 1;
+
+	luaL_buffinit(L, &b);
+	for (;;) {
+		luaL_addlstring(&b, s, n);
+		s += n;
+		len -= n;
+		if (len == 0)
+			break;
+		e = &esc[(unsigned char)*s++];
+		luaL_addlstring(&b, e->escape, e->len);
+		len--;
+		n = lt_escape_span(esc, s, len);
+	}
+	luaL_pushresult(&b);
+	return 1;
+}
+
+/*
+ * Return the value at index idx as string of len bytes.  Numbers are
+ * formatted like tostring() does into num, without becoming a Lua string.
+ */
+static const char *
+tostr(lua_State *L, int idx, char *num, size_t *len)
+{
+	if (lua_type(L, idx) != LUA_TNUMBER)
+		return luaL_checklstring(L, idx, len);
+	if (lua_isinteger(L, idx))
+		*len = snprintf(num, LT_NUMSIZE, LUA_INTEGER_FMT,
+		    (LUAI_UACINT)lua_tointeger(L, idx));
+	else {
+		*len = snprintf(num, LT_NUMSIZE, LUA_NUMBER_FMT,
+		    (LUAI_UACNUMBER)lua_tonumber(L, idx));
+		/* Like Lua, make floats look like floats */
+		if (strspn(num, "-0123456789") == *len) {
+			memcpy(num + *len, ".0", 3);
+			*len += 2;
+		}
+	}
+	return num;
+}
+
+static int
+escape_html(lua_State *L)
+{
+	return escape(L, e_html);
+}
+
+static int
+escape_xml(lua_State *L)
+{
+	return escape(L, e_xml);
+}
+
+static int
+escape_latex(lua_State *L)
+{
+	return escape(L, e_latex);
+}
+
+static int
+escape_url(lua_State *L)
+{
+	return escape(L, e_url);
+}
+
+/* The render state of the coroutine, for the context in upvalue n */
+static struct lt_render *
+upvalue_render(lua_State *L, int n)
+{
+	return lt_render(L, lua_touserdata(L, lua_upvalueindex(n)));
+}
+
+/*
+ * The print function of all templates.  It never changes, so that the
+ * compiled templates can keep it in an upvalue, and hands its arguments to
+ * the current sink of the coroutine.  Like all C functions the templates
+ * call, it passes full buffers on to a sink function last, which can then
+ * yield, see sink_poll().
+ */
+static int
+lt_print(lua_State *L)
+{
+	struct lt_render *r;
+	char num[LT_NUMSIZE];
+	const char *s;
+	size_t len;
+	int n, top;
+
+	r = upvalue_render(L, 1);
+	top = lua_gettop(L);
+	for (n = 1; n <= top; n++) {
+		s = tostr(L, n, num, &len);
+		sink_write(L, r, s, len);
+	}
+	return sink_poll(L, r, 0);
+}
+
+/* Print the value at index 1 escaped, straight into the sink */
+static int
+print_escaped(lua_State *L, int escape)
+{
+	struct lt_render *r;
+	const struct lt_entity *esc, *e;
+	char num[LT_NUMSIZE];
+	const char *s;
+	size_t len, n;
+
+	r = upvalue_render(L, 1);
+	s = tostr(L, 1, num, &len);
+	esc = lt_escape_table(escape);
+	for (;;) {
+		n = lt_escape_span(esc, s, len);
+		sink_write(L, r, s, n);
+		s += n;
+		len -= n;
+		if (len == 0)
+			break;
+		e = &esc[(unsigned char)*s++];
+		sink_write(L, r, e->escape, e->len);
+		len--;
+	}
+	return sink_poll(L, r, 0);
+}
+
+static int
+print_html(lua_State *L)
+{
+	return print_escaped(L, e_html);
+}
+
+static int
+print_xml(lua_State *L)
+{
+	return print_escaped(L, e_xml);
+}
+
+static int
+print_latex(lua_State *L)
+{
+	return print_escaped(L, e_latex);
+}
+
+static int
+print_url(lua_State *L)
+{
+	return print_escaped(L, e_url);
+}
+
+/* Message handler of renders, errors get the template line, see srcmap.c */
+static int
+render_error(lua_State *L)
+{
+	lt_where(L, lua_upvalueindex(1));
+	return 1;
+}
+
+/* print_static(s) prints a large literal, which may be precompressed */
+static int
+lt_print_static(lua_State *L)
+{
+	struct lt_render *r;
+
+	luaL_checktype(L, 1, LUA_TSTRING);
+	r = upvalue_render(L, 2);
+	sink_static(L, r, lua_upvalueindex(1), 1);
+	return sink_poll(L, r, 0);
+}
+
+/*
+ * Flatten the extends chain of template n into its dispatch table and
+ * push it.  The dispatch table maps every block name to the most derived
+ * block function, and holds the main function of the root template at
+ * index 1 and the block counters at index 2, see block_counters().  It is
+ * built once and dropped whenever a template is evicted or the counters
+ * are reset.  Templates of the chain that were evicted to make room are
+ * compiled again.
+ */
+static void
+build_dispatch(lua_State *L, struct render_context *ctx, int container,
+    const char *n)
+{
+	const char *t;
+	int d;
+
+	lua_newtable(L);
+	d = lua_gettop(L);
+	lua_getfield(L, container, "template");
+	lua_pushstring(L, n);
+	for (;;) {
+		t = lua_tostring(L, -1);
+		if (lua_getfield(L, d + 1, t) != LUA_TTABLE) {
+			lua_pop(L, 1);
+			lua_pushvalue(L, container);
+			if (process_file(L, ctx, t))
+				luaL_error(L, "template %s is not loaded: %s",
+				    t, lua_tostring(L, -1));
+			lua_pop(L, 1);
+			ctx->misses++;
+			if (lua_getfield(L, d + 1, t) != LUA_TTABLE)
+				luaL_error(L, "template %s is not loaded", t);
+		}
+		lua_getfield(L, -1, "blk");
+		lua_pushnil(L);
+		while (lua_next(L, -2)) {
+			lua_pushvalue(L, -2);
+			if (lua_rawget(L, d) == LUA_TNIL) {
+				lua_pushvalue(L, -3);
+				lua_pushvalue(L, -3);
+				lua_rawset(L, d);
+			}
+			lua_pop(L, 2);
+		}
+		lua_pop(L, 1);
+
+		if (lua_getfield(L, -1, "extends") == LUA_TNIL) {
+			lua_getfield(L, -2, "main");
+			lua_rawseti(L, d, 1);
+			lua_pop(L, 4);
+			break;
+		}
+		lua_remove(L, -2);
+		lua_remove(L, -2);
+	}
+
+	lua_getfield(L, container, "dispatch");
+	lua_pushstring(L, n);
+	lua_pushvalue(L, d);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+}
+
+/* Push the dispatch table of template n */
+static void
+dispatch(lua_State *L, int container, int n)
+{
+	lua_getfield(L, container, "dispatch");
+	lua_pushvalue(L, n);
+	if (lua_rawget(L, -2) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		build_dispatch(L, lua_touserdata(L, lua_upvalueindex(2)),
+		    container, lua_tostring(L, n));
+	}
+	lua_remove(L, -2);
+}
+
+/* Blocks and templates without code are compiled to their text */
+static void
+write_static(lua_State *L)
+{
+	sink_static(L, upvalue_render(L, 2), lua_upvalueindex(1), -1);
+}
+
+/*
+ * Push the counters of block b, at index 3, of template t, at index 2.
+ * They are kept in the dispatch table at index 4, so that calls of the
+ * block don't look them up in the stats table.
+ */
+static void
+block_counters(lua_State *L)
+{
+	if (lua_rawgeti(L, 4, 2) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, 4, 2);
+	}
+	lua_pushvalue(L, 3);
+	if (lua_rawget(L, -2) != LUA_TUSERDATA) {
+		lua_pop(L, 1);
+		lt_block_stats(L, lua_upvalueindex(1), lua_tostring(L, 2),
+		    lua_tostring(L, 3));
+		lua_pushvalue(L, 3);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, -4);
+	}
+	lua_remove(L, -2);
+}
+
+/* What is left of render_block() after the block ran, or yielded */
+static int
+render_block_k(lua_State *L, int status, lua_KContext start)
+{
+	struct lt_block_stats *bs;
+
+	bs = lua_touserdata(L, 6);
+	bs->count++;
+	bs->time += lt_nsec() - start;
+	return sink_poll(L, upvalue_render(L, 2), 0);
+}
+
+/* render_block(env, t, b) renders block b of template t */
+static int
+render_block(lua_State *L)
+{
+	lua_Integer start;
+
+	lua_settop(L, 3);
+	dispatch(L, lua_upvalueindex(1), 2);
+	lua_pushvalue(L, 3);
+	if (lua_rawget(L, 4) == LUA_TNIL)
+		return 0;
+	block_counters(L);
+	start = lt_nsec();
+	if (lua_type(L, 5) == LUA_TSTRING) {
+		lua_pushvalue(L, 5);
+		write_static(L);
+	} else {
+		lua_pushvalue(L, 5);
+		lua_pushvalue(L, 1);
+		lua_callk(L, 1, 0, start, render_block_k);
+	}
+	return render_block_k(L, LUA_OK, start);
+}
+
+static int
+render_template_k(lua_State *L, int status, lua_KContext k)
+{
+	return sink_poll(L, upvalue_render(L, 2), 0);
+}
+
+/*
+ * render_template(env, n) renders template n.  The helper functions are
+ * upvalues of the compiled templates, env is not modified.
+ */
+static int
+render_template(lua_State *L)
+{
+	lua_settop(L, 2);
+	dispatch(L, lua_upvalueindex(1), 2);
+	lt_touch(L, lua_touserdata(L, lua_upvalueindex(2)),
+	    lua_upvalueindex(1), lua_tostring(L, 2));
+	if (lua_rawgeti(L, -1, 1) == LUA_TSTRING)
+		write_static(L);
+	else {
+		lua_pushvalue(L, 1);
+		lua_pushvalue(L, 2);
+		lua_callk(L, 2, 0, 0, render_template_k);
+	}
+	return render_template_k(L, LUA_OK, 0);
+}
+
+static int
+template_context(lua_State *L)
+{
+	struct render_context *ctx;
+	int setup, print, finish;
+	struct luaL_Reg lt_escapes[] = {
+		{ "escape_html",	escape_html },
+		{ "escape_xml",		escape_xml },
+		{ "escape_url",		escape_url },
+		{ "escape_latex",	escape_latex },
+		{ NULL, NULL }
+	};
+	struct luaL_Reg lt_printers[] = {
+		{ "print",		lt_print },
+		{ "print_html",		print_html },
+		{ "print_xml",		print_xml },
+		{ "print_url",		print_url },
+		{ "print_latex",	print_latex },
+		{ NULL, NULL }
+	};
+
+	ctx = lua_newuserdata(L, sizeof(struct render_context));
+	luaL_setmetatable(L, TEMPLATE_CONTEXT_METATABLE);
+
+	/* The container for everything */
+	lua_newtable(L);
+	luaL_setfuncs(L, lt_escapes, 0);
+
+	lua_pushvalue(L, -2);
+	luaL_setfuncs(L, lt_printers, 1);
+	lt_formatters(L);
+
+	/* A place to store templates, initially empty */
+	lua_newtable(L);
+	lua_setfield(L, -2, "template");
+
+	/* Where templates were found, see lookup() */
+	lua_newtable(L);
+	lua_setfield(L, -2, "resolved");
+
+	lua_getglobal(L, "string");
+	lua_setfield(L, -2, "string");
+
+	/* Flattened extends chains, see build_dispatch() */
+	lua_newtable(L);
+	lua_setfield(L, -2, "dispatch");
+
+	/* Templates by recent use, see lt_touch() */
+	lua_newtable(L);
+	lua_setfield(L, -2, "lru");
+
+	/* Templates being compiled, see process_includes() */
+	lua_newtable(L);
+	lua_setfield(L, -2, "processing");
+
+	/* Add the required functions to the container */
+	lua_pushvalue(L, -1);
+	lua_pushvalue(L, -3);
+	lua_pushcclosure(L, render_block, 2);
+	lua_setfield(L, -2, "render_block");
+
+	lua_pushvalue(L, -1);
+	lua_pushvalue(L, -3);
+	lua_pushcclosure(L, render_template, 2);
+	lua_setfield(L, -2, "render_template");
+
+	lua_pushvalue(L, -1);
+	lua_pushvalue(L, -3);
+	lua_pushcclosure(L, lt_print_static, 2);
+	lua_setfield(L, -2, "print_static");
+
+	/* The message handler of renders, see render_run() */
+	lua_pushvalue(L, -1);
+	lua_pushcclosure(L, render_error, 1);
+	lua_setfield(L, -2, "render_error");
+
+	/* Precompressed static literals, see sink_static() */
+	lua_newtable(L);
+	lua_setfield(L, -2, "compressed");
+
+	/* Counters per template, see stats.c */
+	lua_newtable(L);
+	lua_setfield(L, -2, "stats");
+
+	/* Fragment caching, see fragment.c */
+	lua_newtable(L);
+	lua_setfield(L, -2, "fragments");
+
+	lua_pushvalue(L, -2);
+	lua_pushcclosure(L, fragment_begin, 1);
+	lua_setfield(L, -2, "cache_begin");
+
+	lua_pushvalue(L, -2);
+	lua_pushcclosure(L, fragment_end, 1);
+	lua_setfield(L, -2, "cache_end");
+
+	/* Associate the container with this context */
+	lua_setuservalue(L, -2);
+
+	/* Render states by coroutine, see render_state() */
+	lua_newtable(L);
+	lua_createtable(L, 0, 1);
+	lua_pushliteral(L, "k");
+	lua_setfield(L, -2, "__mode");
+	lua_setmetatable(L, -2);
+	ctx->renders = luaL_ref(L, LUA_REGISTRYINDEX);
+	ctx->cur = NULL;
+	LIST_INIT(&ctx->states);
+	TAILQ_INIT(&ctx->active);
+	ctx->bufsize = BUFFER_SIZE;
+	ctx->cachedir = NULL;
+	ctx->roots = NULL;
+	ctx->nativedir = NULL;
+	ctx->shared = 0;
+	ctx->minify = 0;
+	ctx->inlining = 0;
+	ctx->compress = 0;
+	ctx->revalidate = 0;
+	ctx->wfd = -1;
+	SLIST_INIT(&ctx->watches);
+	ctx->tick = 0;
+	ctx->maxtemplates = ctx->maxbytes = 0;
+	ctx->hits = ctx->misses = ctx->evictions = 0;
+	ctx->fragbytes = 0;
+	ctx->maxfragbytes = LT_FRAGMENT_LIMIT;
+	ctx->fraghits = ctx->fragmisses = 0;
+	ctx->alloc = NULL;
+	ctx->debug = 0;
+	return 1;
+}
+
+/*
+ * Templates that can be evicted are kept in a list from the most to the
+ * least recently used, linked through the newer and older fields of their
+ * entries.  The lru table of the container holds the ends of the list,
+ * and the number and source size of the templates in it.
+ */
+
+/* Add d to the integer field k of the table at index t */
+static void
+add_count(lua_State *L, int t, const char *k, lua_Integer d)
+{
+	lua_getfield(L, t, k);
+	lua_pushinteger(L, lua_tointeger(L, -1) + d);
+	lua_setfield(L, t, k);
+	lua_pop(L, 1);
+}
+
+/* Remove the listed template entry at index e from the list at index lru */
+static void
+lru_unlink(lua_State *L, int lru, int e)
+{
+	lua_getfield(L, e, "newer");
+	lua_getfield(L, e, "older");
+	lua_pushvalue(L, -1);
+	if (lua_isnil(L, -3))
+		lua_setfield(L, lru, "newest");
+	else
+		lua_setfield(L, -3, "older");
+	lua_pushvalue(L, -2);
+	if (lua_isnil(L, -2))
+		lua_setfield(L, lru, "oldest");
+	else
+		lua_setfield(L, -2, "newer");
+	lua_pop(L, 2);
+
+	lua_pushnil(L);
+	lua_setfield(L, e, "newer");
+	lua_pushnil(L);
+	lua_setfield(L, e, "older");
+	lua_pushnil(L);
+	lua_setfield(L, e, "listed");
+	add_count(L, lru, "count", -1);
+	lua_getfield(L, e, "size");
+	add_count(L, lru, "bytes", -lua_tointeger(L, -1));
+	lua_pop(L, 1);
+}
+
+/*
+ * Mark template fnam as used now, moving it to the front of the list or
+ * adding it when it is new.  Templates from bundles are not listed.  The
+ * name of the template it extends, or nil, is left on the stack.
+ */
+static void
+touch(lua_State *L, struct render_context *ctx, int container,
+    const char *fnam)
+{
+	int top, lru, e;
+
+	top = lua_gettop(L);
+	lua_getfield(L, container, "lru");
+	lru = top + 1;
+	lua_getfield(L, container, "template");
+	if (lua_getfield(L, -1, fnam) != LUA_TTABLE) {
+		lua_settop(L, top);
+		lua_pushnil(L);
+		return;
+	}
+	e = top + 3;
+	lua_pushinteger(L, ++ctx->tick);
+	lua_setfield(L, e, "used");
+	lua_getfield(L, e, "bundled");
+	if (lua_toboolean(L, -1))
+		goto done;
+	if (lua_getfield(L, e, "listed") != LUA_TNIL) {
+		lua_getfield(L, lru, "newest");
+		if (lua_rawequal(L, -1, e))
+			goto done;
+		lru_unlink(L, lru, e);
+	}
+
+	lua_pushboolean(L, 1);
+	lua_setfield(L, e, "listed");
+	lua_pushstring(L, fnam);
+	lua_setfield(L, e, "name");
+	add_count(L, lru, "count", 1);
+	lua_getfield(L, e, "size");
+	add_count(L, lru, "bytes", lua_tointeger(L, -1));
+	lua_pop(L, 1);
+
+	if (lua_getfield(L, lru, "newest") == LUA_TNIL) {
+		lua_pushvalue(L, e);
+		lua_setfield(L, lru, "oldest");
+	} else {
+		lua_pushvalue(L, e);
+		lua_setfield(L, -2, "newer");
+	}
+	lua_setfield(L, e, "older");
+	lua_pushvalue(L, e);
+	lua_setfield(L, lru, "newest");
+done:
+	lua_getfield(L, e, "extends");
+	lua_replace(L, top + 1);
+	lua_settop(L, top + 1);
+}
+
+/*
+ * Mark template fnam and the templates it extends as used, since they are
+ * used whenever it is.
+ */
+void
+lt_touch(lua_State *L, struct render_context *ctx, int container,
+    const char *fnam)
+{
+	int n;
+
+	touch(L, ctx, container, fnam);
+	for (n = 0; lua_type(L, -1) == LUA_TSTRING && n < LT_MAXEXTENDS; n++) {
+		touch(L, ctx, container, lua_tostring(L, -1));
+		lua_remove(L, -2);
+	}
+	lua_pop(L, 1);
+}
+
+/*
+ * Remove a template from the template table of the container.  All
+ * dispatch tables are dropped, since fnam can be part of any extends
+ * chain.
+ */
+void
+lt_evict(lua_State *L, int container, const char *fnam)
+{
+	int top;
+
+	top = lua_gettop(L);
+	lua_getfield(L, container, "template");
+	if (lua_getfield(L, -1, fnam) == LUA_TTABLE
+	    && lua_getfield(L, -1, "listed") != LUA_TNIL) {
+		lua_getfield(L, container, "lru");
+		lru_unlink(L, top + 4, top + 2);
+	}
+	lua_settop(L, top + 1);
+	lua_pushnil(L);
+	lua_setfield(L, -2, fnam);
+	lua_pop(L, 1);
+	lua_newtable(L);
+	lua_setfield(L, container, "dispatch");
+}
+
+/* Remove all templates and forget where they were found */
+void
+lt_flush(lua_State *L, int container)
+{
+	lua_newtable(L);
+	lua_setfield(L, container, "template");
+	lua_newtable(L);
+	lua_setfield(L, container, "dispatch");
+	lua_newtable(L);
+	lua_setfield(L, container, "resolved");
+	lua_newtable(L);
+	lua_setfield(L, container, "lru");
+}
+
+/* Forget where fnam was found, so that the search path is searched again */
+static void
+unresolve(lua_State *L, int container, const char *fnam)
+{
+	lua_getfield(L, container, "resolved");
+	lua_pushnil(L);
+	lua_setfield(L, -2, fnam);
+	lua_pop(L, 1);
+}
+
+/* Check whether the template entry at idx includes or extends fnam */
+static int
+depends(lua_State *L, int idx, const char *fnam)
+{
+	int n, found;
+
+	found = 0;
+	if (lua_getfield(L, idx, "deps") == LUA_TTABLE) {
+		for (n = 1; lua_rawgeti(L, -1, n) == LUA_TSTRING; n++) {
+			found = !strcmp(lua_tostring(L, -1), fnam);
+			lua_pop(L, 1);
+			if (found)
+				break;
+		}
+		if (!found)
+			lua_pop(L, 1);	/* the nil ending the list */
+	}
+	lua_pop(L, 1);
+	return found;
+}
+
+/*
+ * Evict fnam and, transitively, every template that includes or extends
+ * it.
+ */
+void
+lt_invalidate(lua_State *L, int container, const char *fnam)
+{
+	int n, t;
+
+	lua_getfield(L, container, "template");
+	t = lua_gettop(L);
+	lua_newtable(L);	/* the dependents, evicted afterwards */
+	n = 0;
+	lua_pushnil(L);
+	while (lua_next(L, t)) {
+		if (depends(L, t + 3, fnam)) {
+			lua_pushvalue(L, -2);
+			lua_rawseti(L, t + 1, ++n);
+		}
+		lua_pop(L, 1);
+	}
+	lt_evict(L, container, fnam);
+	unresolve(L, container, fnam);
+	for (; n > 0; n--) {
+		lua_rawgeti(L, t + 1, n);
+		lt_invalidate(L, container, lua_tostring(L, -1));
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 2);
+}
+
+/*
+ * Check that template fnam and everything it includes or extends is
+ * still up to date for the outer render of r.  Each template is checked
+ * against the file system at most once per revalidation interval, and
+ * only once per outer render, which is told apart by its pin, so that an
+ * include shared along several paths, or rendered again, is checked once.
+ * The interval is counted from when the render started.  Outdated
+ * templates are evicted, together with every template depending on them
+ * along the way, so that process_file() compiles them again.  Returns 0
+ * if fnam can be used, -1 if it is outdated or not loaded.
+ */
+static int
+validate(lua_State *L, struct render_context *ctx, int container,
+    const char *fnam, struct lt_render *r)
+{
+	struct stat sb;
+	lua_Integer checked, pass;
+	char buf[PATH_MAX];
+	const char *path, *dep;
+	int n, bundled, valid;
+
+	lua_getfield(L, container, "template");
+	if (lua_getfield(L, -1, fnam) == LUA_TNIL) {
+		lua_pop(L, 2);
+		return -1;
+	}
+
+	/* Templates loaded from a bundle have no source to check */
+	lua_getfield(L, -1, "bundled");
+	bundled = lua_toboolean(L, -1);
+	lua_getfield(L, -2, "checked");
+	checked = lua_tointeger(L, -1);
+	lua_getfield(L, -3, "pass");
+	pass = lua_tointeger(L, -1);
+	lua_pop(L, 3);
+
+	/*
+	 * With file system watches, changes have already been applied.
+	 * Templates rendered from memory have no file, only what they
+	 * depend on is checked.
+	 */
+	valid = 1;
+	if (!bundled && ctx->wfd == -1 && r->now - checked >= ctx->revalidate
+	    && pass != r->pin) {
+		lua_getfield(L, -1, "path");
+		path = lua_tostring(L, -1);
+		lua_getfield(L, -2, "mtime");
+		if (path != NULL)
+			valid = !stat(path, &sb)
+			    && sb.st_mtime == (time_t)lua_tointeger(L, -1);
+		lua_pop(L, 2);
+
+		/*
+		 * Evicted dependencies are compiled again when used, only
+		 * those inlined into fnam are checked against their file.
+		 */
+		lua_getfield(L, -1, "deps");
+		lua_getfield(L, -2, "imtime");
+		for (n = 1; valid && lua_istable(L, -2); n++) {
+			if (lua_rawgeti(L, -2, n) != LUA_TSTRING) {
+				lua_pop(L, 1);
+				break;
+			}
+			dep = lua_tostring(L, -1);
+			lua_pushvalue(L, -1);
+			if (lua_rawget(L, -6) != LUA_TNIL)
+				valid = !validate(L, ctx, container, dep, r);
+			else if (lua_istable(L, -3)) {
+				if (lua_getfield(L, -3, dep) == LUA_TNUMBER)
+					valid = !lt_resolve(ctx->roots, dep,
+					    buf, sizeof buf, &sb)
+					    && sb.st_mtime ==
+					    (time_t)lua_tointeger(L, -1);
+				lua_pop(L, 1);
+			}
+			lua_pop(L, 2);
+		}
+		lua_pop(L, 2);
+
+		if (valid) {
+			lua_pushinteger(L, r->now);
+			lua_setfield(L, -2, "checked");
+			lua_pushinteger(L, r->pin);
+			lua_setfield(L, -2, "pass");
+		} else {
+			lt_evict(L, container, fnam);
+			unresolve(L, container, fnam);
+		}
+	}
+	lua_pop(L, 2);
+	return valid ? 0 : -1;
+}
+
+/*
+ * Evict least recently used templates until the limits of the context are
+ * met, taking them from the end of the list.  Includes count as used when
+ * they are rendered, the templates a template extends whenever it is.
+ * Nothing used from tick pin on, or since the first of the renders in
+ * progress started, is evicted, which pins the extends chains of all
+ * active renders.  Templates from memory can't be compiled again on
+ * demand, so everything depending on them is evicted along with them.
+ */
+static void
+trim(lua_State *L, struct render_context *ctx, int container,
+    lua_Integer pin)
+{
+	const char *fnam;
+	int top, lru;
+
+	if (!TAILQ_EMPTY(&ctx->active) && TAILQ_FIRST(&ctx->active)->pin < pin)
+		pin = TAILQ_FIRST(&ctx->active)->pin;
+	top = lua_gettop(L);
+	lua_getfield(L, container, "lru");
+	lru = top + 1;
+	for (;;) {
+		lua_getfield(L, lru, "count");
+		lua_getfield(L, lru, "bytes");
+		if ((ctx->maxtemplates == 0
+		    || lua_tointeger(L, -2) <= ctx->maxtemplates)
+		    && (ctx->maxbytes == 0
+		    || lua_tointeger(L, -1) <= ctx->maxbytes))
+			break;
+		if (lua_getfield(L, lru, "oldest") != LUA_TTABLE)
+			break;
+		lua_getfield(L, -1, "used");
+		if (lua_tointeger(L, -1) >= pin)
+			break;
+
+		lua_getfield(L, -2, "name");
+		fnam = lua_tostring(L, -1);
+		if (lua_getfield(L, -3, "hash") != LUA_TNIL)
+			lt_invalidate(L, container, fnam);
+		else
+			lt_evict(L, container, fnam);
+		ctx->evictions++;
+		if (ctx->debug)
+			printf("evicting template %s\n", fnam);
+		lua_settop(L, lru);
+	}
+	lua_settop(L, top);
+}
+
+static int
+render_protected_k(lua_State *L, int status, lua_KContext k)
+{
+	return sink_finish(L, lua_touserdata(L, 1), 0);
+}
+
+/*
+ * Run the template and flush what is left in the buffer, protected by the
+ * caller, so that a failing sink is reported like a render error.
+ */
+static int
+render_protected(lua_State *L)
+{
+	lua_callk(L, 2, 0, 0, render_protected_k);
+	return render_protected_k(L, LUA_OK, 0);
+}
+
+/*
+ * Where render_rows_k() goes on, kept in its context along with the
+ * number n of the row: after row n - 1 was rendered, after the callback
+ * for it returned, or after the iterator returned row n.
+ */
+#define ROWS_RENDERED		0
+#define ROWS_PASSED		1
+#define ROWS_FETCHED		2
+#define ROWS_K(n, state)	((lua_KContext)(n) * 4 + (state))
+
+/*
+ * What is left of a batch at the point k: the separator or callback, and
+ * the rows that follow.  The row iterator, the callback and the template
+ * may yield.  The number of rows is returned.
+ */
+static int
+render_rows_k(lua_State *L, int status, lua_KContext k)
+{
+	struct lt_render *r;
+	lua_Integer n;
+	const char *sep;
+	size_t len;
+	int state;
+
+	/* r, render_template, rows, the template name, sep or callback */
+	r = lua_touserdata(L, 1);
+	state = k % 4;
+	for (n = k / 4;; n++) {
+		if (state == ROWS_RENDERED && n > 0 && lua_isfunction(L, 5)) {
+			lua_pushvalue(L, 5);
+			lua_pushlstring(L, r->out.data + r->sink.base,
+			    r->out.size - r->sink.base);
+			r->out.size = r->sink.base;
+			lua_pushinteger(L, n);
+			lua_callk(L, 2, 0, ROWS_K(n, ROWS_PASSED),
+			    render_rows_k);
+		}
+		if (state != ROWS_FETCHED) {
+			if (lua_istable(L, 3))
+				lua_rawgeti(L, 3, n + 1);
+			else {
+				lua_pushvalue(L, 3);
+				lua_callk(L, 0, 1, ROWS_K(n, ROWS_FETCHED),
+				    render_rows_k);
+			}
+		}
+		state = ROWS_RENDERED;
+
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			break;
+		}
+		if (!lua_istable(L, -1))
+			return luaL_error(L, "row %d is not a table", (int)n + 1);
+		if (n > 0 && lua_type(L, 5) == LUA_TSTRING) {
+			sep = lua_tolstring(L, 5, &len);
+			sink_write(L, r, sep, len);
+		}
+		lua_pushvalue(L, 2);
+		lua_insert(L, -2);
+		lua_pushvalue(L, 4);
+		lua_callk(L, 2, 0, ROWS_K(n + 1, ROWS_RENDERED),
+		    render_rows_k);
+	}
+	lua_pushinteger(L, n);
+	return sink_finish(L, r, 1);
+}
+
+/* Like render_protected(), but for each row of a batch */
+static int
+render_rows(lua_State *L)
+{
+	return render_rows_k(L, LUA_OK, ROWS_K(0, ROWS_RENDERED));
+}
+
+/*
+ * What a render needs after the template ran, kept in a userdata on the
+ * stack, so that it survives a yield.
+ */
+struct render_frame {
+	struct lt_render *r;		/* of the coroutine */
+	struct lt_sink	outer;		/* the sink of an outer render */
+	int		saved;		/* index of its sink function */
+	int		container;
+	lua_Integer	start;
+	lua_Integer	written;
+	lua_Integer	sinkcalls;
+	struct lt_alloc	*alloc;		/* if allocations are counted */
+	lua_Integer	allocbytes;
+	lua_Integer	allocs;
+	lua_Integer	collections;
+};
+
+/*
+ * Return the render state of the running coroutine, created if create is
+ * set, or NULL.  The states are kept in a table with weak keys, so that
+ * the state of a coroutine goes away with it, even if it never finished
+ * a render.
+ */
+static struct lt_render *
+render_state(lua_State *L, struct render_context *ctx, int create)
+{
+	struct lt_render *r;
+	int top;
+
+	top = lua_gettop(L);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->renders);
+	lua_pushthread(L);
+	if (lua_rawget(L, top + 1) == LUA_TUSERDATA)
+		r = lua_touserdata(L, -1);
+	else if (!create)
+		r = NULL;
+	else {
+		r = lua_newuserdata(L, sizeof(struct lt_render));
+		if (buf_init(&r->out))
+			luaL_error(L, "memory error");
+		r->L = L;
+		r->ctx = ctx;
+		r->sink.type = LT_SINK_BUFFER;
+		r->sink.fd = -1;
+		r->sink.base = 0;
+		r->sink.z = NULL;
+		lua_pushboolean(L, 0);
+		r->sinkref = luaL_ref(L, LUA_REGISTRYINDEX);
+		r->depth = 0;
+		r->pin = r->now = 0;
+		r->ncapture = 0;
+		r->written = r->sinkcalls = 0;
+		luaL_setmetatable(L, LT_RENDER_METATABLE);
+		LIST_INSERT_HEAD(&ctx->states, r, next);
+		lua_pushthread(L);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, top + 1);
+	}
+	lua_settop(L, top);
+	if (r != NULL)
+		ctx->cur = r;
+	return r;
+}
+
+/*
+ * Return the render state of the running coroutine for the C functions
+ * templates call.  It is looked up again when the coroutine changed.
+ */
+struct lt_render *
+lt_render(lua_State *L, struct render_context *ctx)
+{
+	struct lt_render *r;
+
+	if (ctx->cur != NULL && ctx->cur->L == L)
+		return ctx->cur;
+	if ((r = render_state(L, ctx, 0)) == NULL || r->depth == 0)
+		luaL_error(L, "not rendering in this coroutine");
+	return r;
+}
+
+/* Release a render state, after its coroutine or the context is gone */
+static int
+render_state_gc(lua_State *L)
+{
+	struct lt_render *r;
+
+	r = luaL_checkudata(L, 1, LT_RENDER_METATABLE);
+	if (r->ctx != NULL) {
+		if (r->depth > 0)
+			TAILQ_REMOVE(&r->ctx->active, r, active);
+		LIST_REMOVE(r, next);
+		if (r->ctx->cur == r)
+			r->ctx->cur = NULL;
+		r->ctx = NULL;
+	}
+	fragment_unwind(L, r, 0);
+	sink_compress_end(r);
+	buf_free(&r->out);
+	luaL_unref(L, LUA_REGISTRYINDEX, r->sinkref);
+	return 0;
+}
+
+/*
+ * Compile fnam, from source unless it is NULL, if needed.  The container
+ * must be on top of the stack.  On error, a message is left on the stack
+ * and -1 is returned, the caller is responsible for raising the error.
+ */
+static int
+render_prepare(lua_State *L, struct render_context *ctx, struct lt_render *r,
+    const char *fnam, const char *source, size_t len)
+{
+	lua_Integer hash;
+	int container, miss, rv;
+
+	container = lua_gettop(L);
+	if (ctx->wfd != -1)
+		lt_watch_drain(L, ctx, container);
+
+	/* Includes compiled along with fnam are pinned, too */
+	if (r->depth == 0) {
+		r->pin = ++ctx->tick;
+		r->now = lt_msec();
+	}
+	if (source != NULL) {
+		/* A template with different source replaces the old one */
+		hash = (lua_Integer)lt_hash(source, len);
+		lua_getfield(L, container, "template");
+		if (lua_getfield(L, -1, fnam) == LUA_TTABLE) {
+			lua_getfield(L, -1, "hash");
+			if (!lua_isinteger(L, -1)
+			    || lua_tointeger(L, -1) != hash)
+				lt_invalidate(L, container, fnam);
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 2);
+		miss = validate(L, ctx, container, fnam, r);
+		rv = miss && process_string(L, ctx, fnam, source, len, hash);
+	} else {
+		miss = validate(L, ctx, container, fnam, r);
+		rv = miss && process_file(L, ctx, fnam);
+	}
+	if (rv) {
+		lua_pushfstring(L, "processing failed: %s",
+		    lua_tostring(L, -1));
+		return -1;
+	}
+
+	lt_touch(L, ctx, container, fnam);
+
+	if (!miss)
+		ctx->hits++;
+	else {
+		ctx->misses++;
+		if (ctx->maxtemplates > 0 || ctx->maxbytes > 0)
+			trim(L, ctx, container, r->pin);
+	}
+	return 0;
+}
+
+/*
+ * Render the template named at index 2 using the table at index data as
+ * environment.  If sep is not 0, data holds the rows of a batch and sep
+ * the separator or callback, see render_batch().  A render frame and the
+ * container must be on top of the stack, the sink set up.  The template
+ * runs in a pcall with k, the continuation of the calling C function,
+ * which must return the result, so that the template can yield.  k is
+ * called with the index of the frame and has to call render_end().
+ */
+static int
+render_run(lua_State *L, struct render_context *ctx, int data, int sep,
+    lua_KFunction k)
+{
+	struct render_frame *frame;
+	struct lt_render *r;
+	int container;
+
+	container = lua_gettop(L);
+	frame = lua_touserdata(L, container - 1);
+	frame->container = container;
+	r = frame->r;
+	lua_getfield(L, container, "render_error");
+	lua_pushcfunction(L, sep ? render_rows : render_protected);
+	lua_pushlightuserdata(L, r);
+	lua_getfield(L, container, "render_template");
+	lua_pushvalue(L, data);
+	lua_pushvalue(L, 2);
+	if (sep)
+		lua_pushvalue(L, sep);
+	if (r->depth++ == 0)
+		TAILQ_INSERT_TAIL(&ctx->active, r, active);
+	frame->start = lt_nsec();
+	frame->written = r->written;
+	frame->sinkcalls = r->sinkcalls;
+	if ((frame->alloc = ctx->alloc) != NULL) {
+		frame->allocbytes = ctx->alloc->bytes;
+		frame->allocs = ctx->alloc->allocs;
+		frame->collections = ctx->alloc->collections;
+	}
+	return k(L, lua_pcallk(L, sep ? 5 : 4, 1, container + 1, container - 1,
+	    k), container - 1);
+}
+
+/*
+ * Account for the render of the frame at index f, whose pcall returned
+ * status and, for a batch, the number of rows.  On error, a message is
+ * left on the stack and -1 is returned.
+ */
+static int
+render_end(lua_State *L, struct render_context *ctx, int f, int status)
+{
+	struct render_frame *frame;
+	struct lt_render *r;
+	struct lt_stats *st;
+	lua_Integer ns;
+	int failed;
+
+	frame = lua_touserdata(L, f);
+	r = frame->r;
+	fragment_unwind(L, r, r->depth);
+	if (--r->depth == 0) {
+		TAILQ_REMOVE(&ctx->active, r, active);
+		if (ctx->cur == r)
+			ctx->cur = NULL;
+	}
+
+	failed = status != LUA_OK && status != LUA_YIELD;
+	st = lt_stats(L, frame->container, lua_tostring(L, 2));
+	st->renders += !failed && lua_isinteger(L, -1) ?
+	    lua_tointeger(L, -1) : 1;
+	ns = lt_nsec() - frame->start;
+	st->render_time += ns;
+	if (ns > st->render_max)
+		st->render_max = ns;
+	st->bytes += r->written - frame->written;
+	st->sink_calls += r->sinkcalls - frame->sinkcalls;
+	if (frame->alloc != NULL) {
+		st->alloc_bytes += frame->alloc->bytes - frame->allocbytes;
+		st->allocs += frame->alloc->allocs - frame->allocs;
+		st->collections += frame->alloc->collections
+		    - frame->collections;
+	}
+	if (failed) {
+		printf("\nrender error, %s\n", lua_tostring(L, -1));
+		return -1;
+	}
+	return 0;
+}
+
+/* Push a render frame for r, which keeps the current sink as the outer one */
+static struct render_frame *
+push_frame(lua_State *L, struct lt_render *r)
+{
+	struct render_frame *frame;
+
+	frame = lua_newuserdata(L, sizeof(struct render_frame));
+	frame->r = r;
+	frame->outer = r->sink;
+	frame->saved = 0;
+	return frame;
+}
+
+/* Restore the sink of the outer render and return or raise the result */
+static int
+render_sink_end(lua_State *L, struct render_frame *frame, int rv)
+{
+	struct lt_render *r = frame->r;
+
+	/* Drop what could not be written on error */
+	r->out.size = r->sink.base;
+	sink_compress_end(r);
+	r->sink = frame->outer;
+	lua_pushvalue(L, frame->saved);
+	lua_rawseti(L, LUA_REGISTRYINDEX, r->sinkref);
+
+	if (rv)
+		return luaL_error(L, "%s", lua_tostring(L, -1));
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int
+render_sink_k(lua_State *L, int status, lua_KContext f)
+{
+	struct render_context *ctx;
+
+	ctx = lua_touserdata(L, 1);
+	return render_sink_end(L, lua_touserdata(L, f),
+	    render_end(L, ctx, f, status));
+}
+
+/*
+ * Render a template to the sink at index sink, which is a function called
+ * with chunks of the output, a file descriptor or an io file, and defaults
+ * to io.write.  Output is collected and passed on in chunks of about
+ * bufsize bytes.  A sink function may yield when the render runs in a
+ * coroutine, the render continues when the coroutine is resumed.
+ */
+static int
+render_sink(lua_State *L, const char *fnam, const char *source, size_t len,
+    int data, int sink, int sep)
+{
+	struct render_context *ctx;
+	struct render_frame *frame;
+	struct lt_render *r;
+	luaL_Stream *f;
+
+	ctx = luaL_checkudata(L, 1, TEMPLATE_CONTEXT_METATABLE);
+	if (lua_isnil(L, sink)) {
+		lua_getglobal(L, "io");
+		lua_getfield(L, -1, "write");
+		lua_replace(L, sink);
+		lua_pop(L, 1);
+	}
+
+	/* Output of an outer render must come first */
+	r = render_state(L, ctx, 1);
+	sink_flush(L, r);
+
+	/* Keep the sink of an outer render, if any */
+	lua_rawgeti(L, LUA_REGISTRYINDEX, r->sinkref);
+	frame = push_frame(L, r);
+	frame->saved = lua_gettop(L) - 1;
+
+	if ((f = luaL_testudata(L, sink, LUA_FILEHANDLE)) != NULL) {
+		if (f->closef == NULL)
+			return luaL_error(L, "attempt to use a closed file");
+		fflush(f->f);
+		r->sink.type = LT_SINK_FD;
+		r->sink.fd = fileno(f->f);
+	} else if (lua_isinteger(L, sink)) {
+		r->sink.type = LT_SINK_FD;
+		r->sink.fd = lua_tointeger(L, sink);
+	} else {
+		luaL_checktype(L, sink, LUA_TFUNCTION);
+		lua_pushvalue(L, sink);
+		lua_rawseti(L, LUA_REGISTRYINDEX, r->sinkref);
+		r->sink.type = LT_SINK_FUNCTION;
+	}
+	r->sink.base = r->out.size;
+	r->sink.z = NULL;
+	if (ctx->compress > 0 && sink_compress(r, ctx->compress)) {
+		/* Restores the sink function of an outer render, too */
+		lua_pushliteral(L, "memory error");
+		return render_sink_end(L, frame, -1);
+	}
+
+	lua_getuservalue(L, 1);
+	if (render_prepare(L, ctx, r, fnam, source, len))
+		return render_sink_end(L, frame, -1);
+	return render_run(L, ctx, data, sep, render_sink_k);
+}
+
+static int
+render_file(lua_State *L)
+{
+	const char *fnam;
+
+	luaL_checkudata(L, 1, TEMPLATE_CONTEXT_METATABLE);
+	fnam = luaL_checkstring(L, 2);
+	lua_settop(L, 4);
+	return render_sink(L, fnam, NULL, 0, 3, 4, 0);
+}
+
+/*
+ * Render a template from memory, e.g. loaded from a database, under the
+ * given name.  It is only compiled again when the source changes, and can
+ * include or extend other templates of the context.
+ */
+static int
+render_string(lua_State *L)
+{
+	const char *fnam, *source;
+	size_t len;
+
+	luaL_checkudata(L, 1, TEMPLATE_CONTEXT_METATABLE);
+	fnam = luaL_checkstring(L, 2);
+	source = luaL_checklstring(L, 3, &len);
+	lua_settop(L, 5);
+	return render_sink(L, fnam, source, len, 4, 5, 0);
+}
+
+static int
+render_to_string_k(lua_State *L, int status, lua_KContext f)
+{
+	struct render_context *ctx;
+	struct render_frame *frame;
+	struct lt_render *r;
+	int rv;
+
+	ctx = lua_touserdata(L, 1);
+	frame = lua_touserdata(L, f);
+	r = frame->r;
+	rv = render_end(L, ctx, f, status);
+	if (!rv)
+		lua_pushlstring(L, r->out.data + r->sink.base,
+		    r->out.size - r->sink.base);
+	r->out.size = r->sink.base;
+	r->sink = frame->outer;
+
+	if (rv)
+		return luaL_error(L, "%s", lua_tostring(L, -1));
+	return 1;
+}
+
+/*
+ * Render a template into the output buffer of the coroutine and return
+ * the result as a single string, no Lua function is called for the output.
+ */
 static int
-escape(lua_State *L, int escape)
+render_to_string(lua_State *L)
 {
-	luaL_Buffer b;
-	const char *s, *e;
+	struct render_context *ctx;
+	struct render_frame *frame;
+	struct lt_render *r;
+	const char *fnam;
 
-	s = luaL_checkstring(L, -1);
+	ctx = luaL_checkudata(L, 1, TEMPLATE_CONTEXT_METATABLE);
+	fnam = luaL_checkstring(L, 2);
+	lua_settop(L, 3);
 
-	luaL_buffinit(L, &b);
+	/* Nested renders append to the buffer, so remember our start */
+	r = render_state(L, ctx, 1);
+	frame = push_frame(L, r);
+	r->sink.type = LT_SINK_BUFFER;
+	r->sink.base = r->out.size;
+	r->sink.z = NULL;
 
-	for (; *s; s++) {
-		e = lt_escape(escape, *s);
-		if (e != NULL)
-			luaL_addstring(&b, e);
-		else
-			luaL_addchar(&b, *s);
+	lua_getuservalue(L, 1);
+	if (render_prepare(L, ctx, r, fnam, NULL, 0)) {
+		r->sink = frame->outer;
+		return luaL_error(L, "%s", lua_tostring(L, -1));
 	}
-	luaL_pushresult(&b);
+	return render_run(L, ctx, 3, 0, render_to_string_k);
+}
+
+static int
+render_batch_k(lua_State *L, int status, lua_KContext f)
+{
+	struct render_context *ctx;
+	struct render_frame *frame;
+	struct lt_render *r;
+	int rv;
+
+	ctx = lua_touserdata(L, 1);
+	frame = lua_touserdata(L, f);
+	r = frame->r;
+	rv = render_end(L, ctx, f, status);
+	r->out.size = r->sink.base;
+	r->sink = frame->outer;
+
+	if (rv)
+		return luaL_error(L, "%s", lua_tostring(L, -1));
+	lua_pushboolean(L, 1);
 	return 1;
 }
 
+/*
+ * renderBatch(fnam, rows [, sink [, sep]]) renders template fnam once for
+ * each table of the array rows, or for each table an iterator function
+ * returns until it returns nil.  The template is only looked up and
+ * validated once.  The output goes to sink, like for renderFile(), with
+ * the string sep between rows.  If sep is a function, it is called with
+ * the output of each row and its number instead, and sink is not used.
+ */
 static int
-escape_html(lua_State *L)
+render_batch(lua_State *L)
 {
-	return escape(L, e_html);
+	struct render_context *ctx;
+	struct render_frame *frame;
+	struct lt_render *r;
+	const char *fnam;
+
+	ctx = luaL_checkudata(L, 1, TEMPLATE_CONTEXT_METATABLE);
+	fnam = luaL_checkstring(L, 2);
+	if (!lua_istable(L, 3))
+		luaL_checktype(L, 3, LUA_TFUNCTION);
+	lua_settop(L, 5);
+	if (!lua_isnil(L, 5) && !lua_isfunction(L, 5))
+		luaL_checkstring(L, 5);		/* converts a number */
+	if (!lua_isfunction(L, 5))
+		return render_sink(L, fnam, NULL, 0, 3, 4, 5);
+
+	/* Rows are collected in the buffer and passed to the callback */
+	r = render_state(L, ctx, 1);
+	frame = push_frame(L, r);
+	r->sink.type = LT_SINK_BUFFER;
+	r->sink.base = r->out.size;
+	r->sink.z = NULL;
+
+	lua_getuservalue(L, 1);
+	if (render_prepare(L, ctx, r, fnam, NULL, 0)) {
+		r->sink = frame->outer;
+		return luaL_error(L, "%s", lua_tostring(L, -1));
+	}
+	return render_run(L, ctx, 3, 5, render_batch_k);
 }
 
+/*
+ * Limit the number of compiled templates and the approximate memory they
+ * use, measured as the size of their source.  Zero or nil means no limit.
+ */
 static int
-escape_xml(lua_State *L)
+render_cachelimit(lua_State *L)
 {
-	return escape(L, e_xml);
+	struct render_context *ctx;
+
+	ctx = luaL_checkudata(L, 1, TEMPLATE_CONTEXT_METATABLE);
+	ctx->maxtemplates = luaL_optinteger(L, 2, 0);
+	ctx->maxbytes = luaL_optinteger(L, 3, 0);
+	luaL_argcheck(L, ctx->maxtemplates >= 0, 2, "negative limit");
+	luaL_argcheck(L, ctx->maxbytes >= 0, 3, "negative limit");
+	if (ctx->maxtemplates > 0 || ctx->maxbytes > 0) {
+		lua_settop(L, 1);
+		lua_getuservalue(L, 1);
+		trim(L, ctx, 2, ctx->tick + 1);
+	}
+	return 0;
 }
 
+/* Return the template cache counters */
 static int
-escape_latex(lua_State *L)
+render_cachestats(lua_State *L)
 {
-	return escape(L, e_latex);
+	struct render_context *ctx;
+	lua_Integer count, bytes;
+
+	ctx = luaL_checkudata(L, 1, TEMPLATE_CONTEXT_METATABLE);
+	lua_settop(L, 1);
+	lua_getuservalue(L, 1);
+	lua_getfield(L, 2, "lru");
+	lua_getfield(L, 3, "count");
+	count = lua_tointeger(L, -1);
+	lua_getfield(L, 3, "bytes");
+	bytes = lua_tointeger(L, -1);
+	lua_pop(L, 2);
+
+	lua_createtable(L, 0, 8);
+	lua_pushinteger(L, ctx->hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushinteger(L, ctx->misses);
+	lua_setfield(L, -2, "misses");
+	lua_pushinteger(L, ctx->evictions);
+	lua_setfield(L, -2, "evictions");
+	lua_pushinteger(L, count);
+	lua_setfield(L, -2, "templates");
+	lua_pushinteger(L, bytes);
+	lua_setfield(L, -2, "bytes");
+	lua_pushinteger(L, ctx->fraghits);
+	lua_setfield(L, -2, "fragmentHits");
+	lua_pushinteger(L, ctx->fragmisses);
+	lua_setfield(L, -2, "fragmentMisses");
+	lua_pushinteger(L, ctx->fragbytes);
+	lua_setfield(L, -2, "fragmentBytes");
+	return 1;
 }
 
+/*
+ * Set the memory available for cached fragments, and drop all fragments
+ * cached so far.
+ */
 static int
-escape_url(lua_State *L)
+render_fragmentlimit(lua_State *L)
 {
-	return escape(L, e_url);
+	struct render_context *ctx;
+
+	ctx = luaL_checkudata(L, 1, TEMPLATE_CONTEXT_METATABLE);
+	ctx->maxfragbytes = luaL_optinteger(L, 2, ctx->maxfragbytes);
+	luaL_argcheck(L, ctx->maxfragbytes >= 0, 2, "negative limit");
+	lua_settop(L, 1);
+	lua_getuservalue(L, 1);
+	fragment_flush(L, ctx, 2);
+	return 0;
 }
 
-static char *render_block =
-"	local env, t, b = ...\n"
-"	while t ~= nil and template[t].blk[b] == nil do\n"
-"		t = template[t].extends\n"
-"	end\n"
-"	if t ~= nil and template[t].blk[b] ~= nil then\n"
-"		template[t].blk[b](env)\n"
-"	end\n";
-
-static char *render_template =
-"	local env, n = ...\n"
-"	local tn = n\n"
-"\n"
-"	while template[n].extends ~= nil do\n"
-"		n = template[n].extends\n"
-"	end\n"
-"	env.print = print\n"
-"	env.string = string\n"
-"	env.render_block = render_block\n"
-"	env.render_template = render_template\n"
-"	env.escape_html = escape_html\n"
-"	env.escape_xml = escape_xml\n"
-"	env.escape_url = escape_url\n"
-"	env.escape_latex = escape_latex\n"
-"	template[n].main(env, tn)\n";
+/* Return the counters of all templates compiled or rendered so far */
+static int
+render_stats(lua_State *L)
+{
+	luaL_checkudata(L, 1, TEMPLATE_CONTEXT_METATABLE);
+	lua_settop(L, 1);
+	lua_getuservalue(L, 1);
+	lt_push_stats(L, 2);
+	return 1;
+}
 
+/*
+ * Count the Lua heap allocations and garbage collections during renders,
+ * reported by stats() as allocBytes, allocs and collections.  This wraps
+ * the allocator of the Lua state with a counting one and leaves a
+ * userdata behind whose finalizer counts each collection cycle of the
+ * state that completes, and creates the next.  Both stay in place until
+ * the state is closed, as other contexts of the state may count, too.
+ * The counts are those of the whole state, so a render is also charged
+ * with what other coroutines allocate while it is suspended, and with
+ * any collection cycle that completes meanwhile, full or not.
+ */
 static int
-template_context(lua_State *L)
+render_countallocs(lua_State *L)
 {
 	struct render_context *ctx;
-	int setup, print, finish;
-	struct luaL_Reg lt_escapes[] = {
-		{ "escape_html",	escape_html },
-		{ "escape_xml",		escape_xml },
-		{ "escape_url",		escape_url },
-		{ "escape_latex",	escape_latex },
-		{ NULL, NULL }
-	};
 
-	ctx = lua_newuserdata(L, sizeof(struct render_context));
-	luaL_setmetatable(L, TEMPLATE_CONTEXT_METATABLE);
-	SLIST_INIT(&ctx->ihead);
+	ctx = luaL_checkudata(L, 1, TEMPLATE_CONTEXT_METATABLE);
+	ctx->alloc = lua_toboolean(L, 2) ? lt_alloc(L) : NULL;
+	return 0;
+}
 
-	/* The container for everything */
+static int
+render_resetstats(lua_State *L)
+{
+	luaL_checkudata(L, 1, TEMPLATE_CONTEXT_METATABLE);
+	lua_settop(L, 1);
+	lua_getuservalue(L, 1);
 	lua_newtable(L);
-	luaL_setfuncs(L, lt_escapes, 0);
-
-	/* A place to store templates, initially empty */
+	lua_setfield(L, 2, "stats");
 	lua_newtable(L);
-	lua_setfield(L, -2, "template");
-
-	lua_getglobal(L, "string");
-	lua_setfield(L, -2, "string");
-
-	/* Add the required functions to the container */
-	if (luaL_loadbuffer(L, render_block, strlen(render_block),
-	    "render_block"))
-	    	printf("error loading render_block function\n");
-	lua_pushvalue(L, -2);
-	lua_setupvalue(L, -2, 1);
-	lua_setfield(L, -2, "render_block");
+	lua_setfield(L, 2, "dispatch");
+	return 0;
+}
 
-	if (luaL_loadbuffer(L, render_template, strlen(render_template),
-	    "render_template"))
-	    	printf("error loading render_template function\n");
-	lua_pushvalue(L, -2);
-	lua_setupvalue(L, -2, 1);
-	lua_setfield(L, -2, "render_template");
+/* Set the number of bytes collected before output is passed to a sink */
+static int
+render_buffersize(lua_State *L)
+{
+	struct render_context *ctx;
+	lua_Integer size;
 
-	/* Associate the container with this context */
-	lua_setuservalue(L, -2);
-	ctx->debug = 0;
-	return 1;
+	ctx = luaL_checkudata(L, 1, TEMPLATE_CONTEXT_METATABLE);
+	size = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, size > 0, 2, "buffer size must be positive");
+	ctx->bufsize = size;
+	return 0;
 }
 
+/*
+ * Set the number of milliseconds during which a compiled template is used
+ * without checking its files again.
+ */
 static int
-render_file(lua_State *L)
+render_revalidate(lua_State *L)
 {
-	struct stat sb;
-	struct lt_include_head ihead;
-	FILE *fp = NULL;
-	struct auth *auth;
-	time_t mtime;
-	char errmsg[BUFSIZ];
-	const char *fnam;
-	int funcindex;
 	struct render_context *ctx;
-	int globals;
 
 	ctx = luaL_checkudata(L, 1, TEMPLATE_CONTEXT_METATABLE);
-	fnam = luaL_checkstring(L, 2);
+	ctx->revalidate = luaL_checkinteger(L, 2);
+	return 0;
+}
 
-	if (stat(fnam, &sb))
-		luaL_error(L, "can't stat %s", fnam);
+static void
+free_roots(char **roots)
+{
+	char **root;
 
-	lua_getuservalue(L, 1);
-	if (lua_gettop(L) == 5) {
-		lua_pushvalue(L, 4);
-		lua_setfield(L, -2, "print");
-	} else {
-		lua_getglobal(L, "io");;
-		lua_getfield(L, -1, "write");
-		lua_setfield(L, -3, "print");
-		lua_pop(L, 1);
-	}
+	if (roots == NULL)
+		return;
+	for (root = roots; *root != NULL; root++)
+		free(*root);
+	free(roots);
+}
 
-	lua_getfield(L, -1, "template");
-	lua_getfield(L, -1, fnam);
-	if (!lua_isnil(L, -1)) {	/* check mtime */
-		lua_getfield(L, -1, "mtime");
-		mtime = (time_t)luaL_checkinteger(L, -1);
-		lua_pop(L, 1);
-		if (mtime != sb.st_mtime) {
+/*
+ * Set the ordered list of directories templates are searched in, e.g.
+ * { 'tenant', 'theme', '' }, where '' is the current directory.  Without
+ * a list, custom/ and then the current directory are searched.  Templates
+ * compiled so far are dropped.
+ */
+static int
+render_searchpath(lua_State *L)
+{
+	struct render_context *ctx;
+	char **roots;
+	lua_Integer n, i;
+
+	ctx = luaL_checkudata(L, 1, TEMPLATE_CONTEXT_METATABLE);
+	roots = NULL;
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		n = luaL_len(L, 2);
+		for (i = 1; i <= n; i++) {
+			lua_rawgeti(L, 2, i);
+			luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 2,
+			    "directory names expected");
 			lua_pop(L, 1);
-			lua_pushnil(L);
-			lua_setfield(L, -2, fnam);
-			lua_pushnil(L);
 		}
-	}
-
-	if (lua_isnil(L, -1)) {
-		lua_pop(L, 2);
-		if (process_file(L, fnam, &ctx->ihead, ctx->debug)) {
-			return luaL_error(L, "processing failed, %s: %s",
-			    lua_tostring(L, -1), lua_tostring(L, -2));
-		} else {
-			lua_getfield(L, -1, "template");
-			lua_getfield(L, -1, fnam);
-			lua_pushinteger(L, sb.st_mtime);
-			lua_setfield(L, -2, "mtime");
-			lua_pop(L, 2);
+		if ((roots = calloc(n + 1, sizeof(char *))) == NULL)
+			return luaL_error(L, "memory error");
+		for (i = 0; i < n; i++) {
+			lua_rawgeti(L, 2, i + 1);
+			roots[i] = strdup(lua_tostring(L, -1));
+			lua_pop(L, 1);
+			if (roots[i] == NULL) {
+				free_roots(roots);
+				return luaL_error(L, "memory error");
+			}
 		}
-	} else
-		lua_pop(L, 2);
-
-	lua_getfield(L, -1, "render_template");
-	lua_pushvalue(L, 3);
-	lua_pushstring(L, fnam);
-	if (lua_pcall(L, 2, 0, 0)) {
-		printf("\nrender error, %s\n", lua_tostring(L, -1));
-		luaL_error(L,
-#if LT_DEBUG
-		    lt_errmsg(L));
-#else
-		    lua_tostring(L, -1));
-#endif
-		lua_pop(L, 1);	/* error code */
-		lua_pushnil(L);
-		return 2;
 	}
+	free_roots(ctx->roots);
+	ctx->roots = roots;
+	lua_settop(L, 1);
+	lua_getuservalue(L, 1);
+	lt_flush(L, 2);
+	return 0;
+}
 
-	lua_pop(L, 2);
+/*
+ * Switch to invalidating templates on file system events instead of
+ * checking modification times.  All templates are compiled again, so that
+ * they are watched.
+ */
+static int
+render_watch(lua_State *L)
+{
+	struct render_context *ctx;
+	int on;
 
-	lua_pushboolean(L, 1);
-	return 1;
+	ctx = luaL_checkudata(L, 1, TEMPLATE_CONTEXT_METATABLE);
+	on = lua_toboolean(L, 2);
+	lua_settop(L, 1);
+	if (on == (ctx->wfd != -1))
+		return 0;
+
+	lt_watch_stop(ctx);
+	if (on && lt_watch_start(ctx))
+		return luaL_error(L, "can't watch templates: %s",
+		    strerror(errno));
+	lua_getuservalue(L, 1);
+	lt_flush(L, 2);
+	return 0;
 }
 
 static int
@@ -251,12 +1733,204 @@ render_debug(lua_State *L)
 	return 0;
 }
 
+/*
+ * Set the directory where compiled templates are cached, or disable the
+ * cache if dir is nil.
+ */
+static int
+render_cachedir(lua_State *L)
+{
+	struct render_context *ctx;
+	struct stat sb;
+	const char *dir;
+
+	ctx = luaL_checkudata(L, 1, TEMPLATE_CONTEXT_METATABLE);
+	dir = luaL_optstring(L, 2, NULL);
+	if (dir != NULL && (stat(dir, &sb) || !S_ISDIR(sb.st_mode)))
+		return luaL_error(L, "%s is not a directory", dir);
+
+	free(ctx->cachedir);
+	ctx->cachedir = NULL;
+	if (dir != NULL && (ctx->cachedir = strdup(dir)) == NULL)
+		return luaL_error(L, "memory error");
+	return 0;
+}
+
+/*
+ * Set the directory with native template modules built from the output of
+ * ltc -c, or stop using them if dir is nil.  Templates compiled so far
+ * are dropped.
+ */
+static int
+render_nativedir(lua_State *L)
+{
+	struct render_context *ctx;
+	struct stat sb;
+	const char *dir;
+
+	ctx = luaL_checkudata(L, 1, TEMPLATE_CONTEXT_METATABLE);
+	dir = luaL_optstring(L, 2, NULL);
+	if (dir != NULL && (stat(dir, &sb) || !S_ISDIR(sb.st_mode)))
+		return luaL_error(L, "%s is not a directory", dir);
+
+	free(ctx->nativedir);
+	ctx->nativedir = NULL;
+	if (dir != NULL && (ctx->nativedir = strdup(dir)) == NULL)
+		return luaL_error(L, "memory error");
+	lua_settop(L, 1);
+	lua_getuservalue(L, 1);
+	lt_flush(L, 2);
+	return 0;
+}
+
+/*
+ * Compress the output of renderFile() and renderString() with gzip at the
+ * given level, 1 to 9, true for the zlib default.  0, false or nil turn
+ * compression off.  Each render produces a complete gzip stream.
+ */
+static int
+render_compress(lua_State *L)
+{
+	struct render_context *ctx;
+	lua_Integer level;
+
+	ctx = luaL_checkudata(L, 1, TEMPLATE_CONTEXT_METATABLE);
+	if (lua_isboolean(L, 2) || lua_isnoneornil(L, 2))
+		level = lua_toboolean(L, 2) ? 6 : 0;
+	else
+		level = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, level >= 0 && level <= 9, 2, "invalid level");
+	lua_settop(L, 1);
+	if (level == ctx->compress)
+		return 0;
+	ctx->compress = level;
+
+	/* Blobs of the old level are of no use */
+	lua_getuservalue(L, 1);
+	lua_newtable(L);
+	lua_setfield(L, 2, "compressed");
+	return 0;
+}
+
+/*
+ * Minify the literal text of all templates, as if they started with
+ * <%! minify html %>.  Templates compiled so far are dropped.
+ */
+static int
+render_minify(lua_State *L)
+{
+	struct render_context *ctx;
+	int on;
+
+	ctx = luaL_checkudata(L, 1, TEMPLATE_CONTEXT_METATABLE);
+	on = lua_toboolean(L, 2);
+	lua_settop(L, 1);
+	if (on == ctx->minify)
+		return 0;
+	ctx->minify = on;
+	lua_getuservalue(L, 1);
+	lt_flush(L, 2);
+	return 0;
+}
+
+/*
+ * Compile includes of templates without blocks into the including
+ * template instead of rendering them at runtime.  Templates compiled so
+ * far are dropped.
+ */
+static int
+render_inline(lua_State *L)
+{
+	struct render_context *ctx;
+	int on;
+
+	ctx = luaL_checkudata(L, 1, TEMPLATE_CONTEXT_METATABLE);
+	on = lua_toboolean(L, 2);
+	lua_settop(L, 1);
+	if (on == ctx->inlining)
+		return 0;
+	ctx->inlining = on;
+	lua_getuservalue(L, 1);
+	lt_flush(L, 2);
+	return 0;
+}
+
+/*
+ * Load and add compiled templates from and to the store shared by all Lua
+ * states of the process, so that threads compile each template only once.
+ */
+static int
+render_share(lua_State *L)
+{
+	struct render_context *ctx;
+
+	ctx = luaL_checkudata(L, 1, TEMPLATE_CONTEXT_METATABLE);
+	ctx->shared = lua_toboolean(L, 2);
+	return 0;
+}
+
+/*
+ * Compile all templates below a directory on a number of threads, by
+ * default one per processor, before they are first rendered.
+ */
+static int
+render_preload(lua_State *L)
+{
+	struct render_context *ctx;
+	const char *dir;
+	long n;
+
+	ctx = luaL_checkudata(L, 1, TEMPLATE_CONTEXT_METATABLE);
+	dir = luaL_checkstring(L, 2);
+	if ((n = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		n = 1;
+	n = luaL_optinteger(L, 3, n);
+	lua_settop(L, 3);
+	lua_getuservalue(L, 1);
+	if (preload(L, ctx, 4, dir, n))
+		return luaL_error(L, "preload failed: %s",
+		    lua_tostring(L, -1));
+	return 0;
+}
+
+/* Install all templates from a bundle built by ltc */
+static int
+render_loadbundle(lua_State *L)
+{
+	const char *file;
+
+	luaL_checkudata(L, 1, TEMPLATE_CONTEXT_METATABLE);
+	file = luaL_checkstring(L, 2);
+	lua_settop(L, 2);
+	lua_getuservalue(L, 1);
+	if (bundle_load(L, 3, file))
+		return luaL_error(L, "%s", lua_tostring(L, -1));
+	return 0;
+}
+
 static int
 render_clear(lua_State *L)
 {
 	struct render_context *ctx;
+	struct lt_render *r;
 
 	ctx = luaL_checkudata(L, 1, TEMPLATE_CONTEXT_METATABLE);
+
+	/* Render states are released with their coroutines */
+	while ((r = LIST_FIRST(&ctx->states)) != NULL) {
+		if (r->depth > 0)
+			TAILQ_REMOVE(&ctx->active, r, active);
+		LIST_REMOVE(r, next);
+		r->ctx = NULL;
+	}
+	ctx->cur = NULL;
+	luaL_unref(L, LUA_REGISTRYINDEX, ctx->renders);
+	free(ctx->cachedir);
+	free_roots(ctx->roots);
+	ctx->roots = NULL;
+	free(ctx->nativedir);
+	ctx->nativedir = NULL;
+	lt_watch_stop(ctx);
 	lua_pushnil(L);
 	lua_setuservalue(L, -2);
 	return 0;
@@ -271,6 +1945,27 @@ luaopen_template(lua_State *L)
 	};
 	struct luaL_Reg render_methods[] = {
 		{ "renderFile",		render_file },
+		{ "renderString",	render_string },
+		{ "renderToString",	render_to_string },
+		{ "renderBatch",	render_batch },
+		{ "bufferSize",		render_buffersize },
+		{ "cacheDir",		render_cachedir },
+		{ "nativeDir",		render_nativedir },
+		{ "cacheLimit",		render_cachelimit },
+		{ "cacheStats",		render_cachestats },
+		{ "stats",		render_stats },
+		{ "resetStats",		render_resetstats },
+		{ "countAllocs",	render_countallocs },
+		{ "fragmentLimit",	render_fragmentlimit },
+		{ "loadBundle",		render_loadbundle },
+		{ "preload",		render_preload },
+		{ "shareTemplates",	render_share },
+		{ "revalidate",		render_revalidate },
+		{ "searchPath",		render_searchpath },
+		{ "watch",		render_watch },
+		{ "minify",		render_minify },
+		{ "inline",		render_inline },
+		{ "compress",		render_compress },
 		{ "debug",		render_debug },
 		{ NULL, NULL }
 	};
@@ -292,6 +1987,12 @@ luaopen_template(lua_State *L)
 	}
 	lua_pop(L, 1);
 
+	if (luaL_newmetatable(L, LT_RENDER_METATABLE)) {
+		lua_pushcfunction(L, render_state_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_pop(L, 1);
+
 	lua_pushliteral(L, "_COPYRIGHT");
 	lua_pushliteral(L, "Copyright (C) 2016 - 2021 "
 	    "micro systems marc balmer");
@@ -300,7 +2001,7 @@ luaopen_template(lua_State *L)
 	lua_pushliteral(L, "Lua Templates");
 	lua_settable(L, -3);
 	lua_pushliteral(L, "_VERSION");
-	lua_pushliteral(L, "template 1.2.0");
+	lua_pushliteral(L, LT_VERSION);
 	lua_settable(L, -3);
 
 	return 1;
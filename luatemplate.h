@@ -24,11 +24,25 @@
 #ifndef __LUATEMPLATE_H__
 #define __LUATEMPLATE_H__
 
-#ifdef LT_DEBUG
-#define LINEBUFSIZ	64
-#endif
-
 #define	TEMPLATE_CONTEXT_METATABLE	"Lua template rendering context"
+#define	LT_RENDER_METATABLE		"Lua template render state"
+#define LT_VERSION			"template 1.2.0"
+#define LT_CODE_VERSION			10	/* of the generated code */
+
+/* Compile flags */
+#define LT_PRINT	0x01	/* print the generated code */
+#define LT_MINIFY	0x02	/* minify literal text */
+#define LT_INLINE	0x04	/* inline included templates */
+#define LT_NATIVE	0x08	/* literal text for a native module */
+
+/* The flags that change the generated code */
+#define LT_OPTIONS(flags)	((flags) & (LT_MINIFY | LT_INLINE))
+
+/* Nesting of inlined includes */
+#define LT_MAXINLINE	8
+
+/* Length of extends chains marked as used with a template */
+#define LT_MAXEXTENDS	32
 
 enum lt_escapes {
 	e_none = 0,
@@ -38,33 +52,320 @@ enum lt_escapes {
 	e_url
 };
 
+enum lt_sinks {
+	LT_SINK_FUNCTION = 0,	/* a Lua function, io.write by default */
+	LT_SINK_FD,		/* a file descriptor */
+	LT_SINK_BUFFER		/* the output buffer of the context */
+};
+
+/* Fragment caching */
+#define LT_MAXCAPTURE		16	/* nesting of cache regions */
+#define LT_FRAGMENT_LIMIT	(4 * 1024 * 1024)
+
+/* A cache region being captured */
+struct lt_capture {
+	size_t		start;	/* where its output starts in the buffer */
+	lua_Integer	ttl;	/* ms */
+	int		key;	/* registry reference */
+	int		depth;	/* of the render it belongs to */
+};
+
+/* Counters of a template, times are in ns */
+struct lt_stats {
+	lua_Integer	compiles;
+	lua_Integer	compile_time;
+	lua_Integer	renders;
+	lua_Integer	render_time;
+	lua_Integer	render_max;
+	lua_Integer	bytes;
+	lua_Integer	sink_calls;
+	lua_Integer	alloc_bytes;	/* with countAllocs(), see stats.c */
+	lua_Integer	allocs;
+	lua_Integer	collections;	/* of the whole state */
+};
+
+struct lt_block_stats {
+	lua_Integer	count;
+	lua_Integer	time;
+};
+
+/* Allocations of a Lua state, counted by a wrapper of its allocator */
+struct lt_alloc {
+	lua_Alloc	 f;		/* the wrapped allocator */
+	void		*ud;
+	lua_Integer	 bytes;
+	lua_Integer	 allocs;
+	lua_Integer	 collections;	/* garbage collection cycles */
+};
+
+/* Room for a number formatted like tostring() does */
+#define LT_NUMSIZE		64
+
+/* Literals from this size on are compressed once, see sink_static() */
+#define LT_STATIC_MIN		1024
+
+struct lt_deflate;
+
+/* Where the output of a render goes, saved and restored by nested renders */
+struct lt_sink {
+	int			 type;
+	int			 fd;
+	size_t			 base;	/* where the render starts */
+	struct lt_deflate	*z;	/* compression state or NULL */
+};
+
+struct lt_entity {
+	const char	*escape;
+	size_t		 len;
+};
+
+/*
+ * Lines of generated code from line on come from template line tline on,
+ * of the template itself if file is 0, else of the inlined template file.
+ */
+struct lt_line {
+	uint32_t	line;
+	uint32_t	tline;
+	uint32_t	file;
+};
+
+/* The source map of a chunk being generated */
+struct lt_srcmap {
+	struct buffer	runs;		/* struct lt_line, sorted by line */
+	size_t		scanned;	/* code counted so far */
+	uint32_t	line;		/* current line of the code */
+};
+
 struct lt_state {
-#ifdef LT_DEBUG
-	int		 tline;	/* current line in template */
-	int		 lline;	/* current line in produced Lua code */
-	int		*lines;	/* To find template line number */
-	int		 linemax;	/*  size of lines */
-#endif
+	const char		*scanned;	/* template text counted so far */
+	uint32_t		 tline;		/* current line in template */
+	uint32_t		 file;		/* the text being read */
+	struct lt_srcmap	 map[2];	/* of the body and the blocks */
+	struct buffer		 names;		/* of inlined templates */
+	uint32_t		 nnames;
+	struct buffer		*literals;	/* text with LT_NATIVE */
+};
+
+/*
+ * What a native template module exports as LT_NATIVE_SYMBOL.  ltc -c
+ * writes the C source of such a module, which repeats this definition.
+ */
+struct lt_native {
+	int		 version;	/* LT_CODE_VERSION */
+	int		 options;	/* LT_OPTIONS() it was compiled with */
+	const char	*fnam;
+	long long	 mtime;		/* of the template file */
+	long long	 size;
+	const char	*code;		/* lt_dump() output */
+	size_t		 codelen;
+	const char	*text;		/* printed by print_literal() */
+	size_t		 textlen;
 };
+#define LT_NATIVE_SYMBOL	"lt_native"
 
 struct lt_include {
 	SLIST_ENTRY(lt_include) next;
+	struct lt_include *chain;	/* in its hash bucket */
 	char *fnam;
+	uint64_t hash;		/* of fnam, compared first */
+	int64_t mtime;		/* of the file if inlined, else 0 */
+	int64_t size;
+};
+
+/* A set of templates, listed newest first and hashed by name */
+struct lt_include_head {
+	SLIST_HEAD(, lt_include) list;
+	struct lt_include **bucket;
+	size_t nbuckets;
+	size_t count;
+};
+
+struct lt_watch {
+	SLIST_ENTRY(lt_watch) next;
+	int	 wd;		/* watch or file descriptor */
+	int	 isdir;
+	char	*path;		/* what is watched */
+	char	*name;		/* template name or directory it maps to */
+	char	*target;	/* directory waited for, in its parent */
+};
+SLIST_HEAD(lt_watch_head, lt_watch);
+
+/*
+ * The renders in progress in a coroutine, nested ones included.  Each
+ * coroutine renders with its own state, so that others can use the
+ * context while it is suspended.  See lt_render().
+ */
+struct lt_render {
+	lua_State		*L;	/* the coroutine */
+	struct render_context	*ctx;	/* NULL once the context is gone */
+	LIST_ENTRY(lt_render)	 next;
+	TAILQ_ENTRY(lt_render)	 active;	/* while depth > 0 */
+	struct buffer		 out;	/* output buffer */
+	struct lt_sink		 sink;	/* where print writes to */
+	int			 sinkref;	/* sink function */
+	int			 depth;	/* renders in progress */
+	lua_Integer		 pin;	/* first tick of the outer render */
+	lua_Integer		 now;	/* when the outer render started */
+	struct lt_capture	 capture[LT_MAXCAPTURE];
+	int			 ncapture;
+	lua_Integer		 written;	/* bytes passed to sinks */
+	lua_Integer		 sinkcalls;
 };
-SLIST_HEAD(lt_include_head, lt_include);
 
 struct render_context {
-	struct lt_include_head	ihead;
+	size_t			bufsize;	/* flush threshold */
+	int			renders;	/* render states by coroutine */
+	struct lt_render	*cur;	/* the state used last */
+	LIST_HEAD(, lt_render)	states;
+	TAILQ_HEAD(, lt_render)	active;	/* in the order they started */
+	char			*cachedir;	/* bytecode cache */
+	char			**roots;	/* search path or NULL */
+	char			*nativedir;	/* native template modules */
+	int			shared;	/* use the process wide store */
+	int			minify;	/* compile with LT_MINIFY */
+	int			inlining;	/* compile with LT_INLINE */
+	int			compress;	/* gzip level, 0 for none */
+	lua_Integer		revalidate;	/* ms between checks */
+	int			wfd;	/* inotify or kqueue, or -1 */
+	struct lt_watch_head	watches;
+	lua_Integer		tick;	/* template use counter */
+	lua_Integer		maxtemplates;	/* 0 for no limit */
+	lua_Integer		maxbytes;
+	lua_Integer		hits;
+	lua_Integer		misses;
+	lua_Integer		evictions;
+	lua_Integer		fragbytes;	/* cached fragments */
+	lua_Integer		maxfragbytes;
+	lua_Integer		fraghits;
+	lua_Integer		fragmisses;
+	struct lt_alloc		*alloc;	/* NULL unless counting */
 	int			debug;
 };
 
-extern int process_file(lua_State *L, const char *fnam,
-    struct lt_include_head *ihead, int print);
-extern const char *reader(lua_State *L, char *, struct lt_state *,
-    struct lt_include_head *includes, const char *, int);
-#ifdef LT_DEBUG
-extern const char *lt_errmsg(lua_State *L);
-#endif
+/* The compile flags of a context */
+#define LT_FLAGS(ctx)	(((ctx)->debug ? LT_PRINT : 0) \
+			| ((ctx)->minify ? LT_MINIFY : 0) \
+			| ((ctx)->inlining ? LT_INLINE : 0))
+
+extern int process_file(lua_State *L, struct render_context *ctx,
+    const char *fnam);
+extern int process_string(lua_State *L, struct render_context *ctx,
+    const char *fnam, const char *source, size_t len, lua_Integer hash);
+extern int process_includes(lua_State *L, struct render_context *ctx,
+    int container, const char *fnam, struct lt_include_head *includes);
+extern int lt_install(lua_State *L, struct render_context *ctx,
+    int container, const char *fnam, const char *path, struct stat *);
+extern char *lt_default_roots[];
+extern int lt_resolve(char **roots, const char *fnam, char *path, size_t len,
+    struct stat *);
+extern int lt_compile(lua_State *L, const char *fnam, const char *path,
+    struct stat *, struct lt_state *, struct lt_include_head *includes,
+    char **roots, int flags);
+extern int lt_compile_string(lua_State *L, const char *fnam,
+    const char *source, size_t, struct lt_state *,
+    struct lt_include_head *includes, char **roots, int flags);
+extern int lt_run(lua_State *L, int container);
+extern lua_Integer lt_msec(void);
+extern struct lt_render *lt_render(lua_State *L, struct render_context *);
+extern void lt_touch(lua_State *L, struct render_context *, int container,
+    const char *fnam);
+extern void lt_evict(lua_State *L, int container, const char *fnam);
+extern void lt_invalidate(lua_State *L, int container, const char *fnam);
+extern void lt_flush(lua_State *L, int container);
+extern void lt_init_includes(struct lt_include_head *);
+extern struct lt_include *lt_find_include(struct lt_include_head *,
+    const char *);
+extern struct lt_include *lt_add_include(struct lt_include_head *,
+    const char *);
+extern void lt_free_includes(struct lt_include_head *);
+extern int reader(lua_State *L, const char *, size_t, struct lt_state *,
+    struct lt_include_head *includes, char **roots, const char *, int);
 extern const char *lt_escape(int escape, char c);
+extern const struct lt_entity *lt_escape_table(int escape);
+extern size_t lt_escape_span(const struct lt_entity *, const char *, size_t);
+
+/* Compiled template serialization and the bytecode cache */
+extern int lt_dump(lua_State *L, struct buffer *,
+    struct lt_include_head *includes);
+extern uint64_t lt_hash(const char *, size_t);
+extern int lt_undump(lua_State *L, const char **, const char *,
+    struct lt_include_head *includes);
+extern uint64_t lt_roots_hash(char **roots);
+extern uint64_t lt_code_key(const char *path, const char *fnam, char **roots,
+    int options);
+extern int cache_load(lua_State *L, const char *dir, const char *path,
+    const char *fnam, char **roots, struct stat *,
+    struct lt_include_head *includes, int options);
+extern void cache_store(lua_State *L, const char *dir, const char *path,
+    const char *fnam, char **roots, struct stat *,
+    struct lt_include_head *includes, int options);
+extern int store_load(lua_State *L, const char *path, const char *fnam,
+    char **roots, struct stat *, struct lt_include_head *includes,
+    int options);
+extern void store_add(lua_State *L, const char *path, const char *fnam,
+    char **roots, struct stat *, struct lt_include_head *includes,
+    int options);
+extern void bundle_init(struct buffer *);
+extern int bundle_add(lua_State *L, struct buffer *, const char *fnam,
+    struct stat *, struct lt_include_head *includes);
+extern int bundle_load(lua_State *L, int container, const char *file);
+
+/* Native template modules */
+extern int native_load(lua_State *L, struct render_context *, const char *,
+    struct stat *, struct lt_include_head *includes, int options);
+
+/* Parallel compilation */
+extern int preload(lua_State *L, struct render_context *ctx, int container,
+    const char *dir, int nthreads);
+
+/* Fragment caching */
+extern int fragment_begin(lua_State *L);
+extern int fragment_end(lua_State *L);
+extern void fragment_unwind(lua_State *L, struct lt_render *, int);
+extern void fragment_flush(lua_State *L, struct render_context *, int);
+
+/* Source maps */
+extern void srcmap_init(struct lt_state *, const char *);
+extern void srcmap_free(struct lt_state *);
+extern void srcmap_scan(struct lt_srcmap *, struct buffer *);
+extern void srcmap_mark(struct lt_state *, int, struct buffer *,
+    const char *);
+extern uint32_t srcmap_file(struct lt_state *, const char *);
+extern void srcmap_join(struct lt_state *, struct buffer *, struct buffer *,
+    size_t);
+extern void srcmap_emit(struct lt_state *, struct buffer *, const char *);
+extern void srcmap_remap(lua_State *L, struct lt_state *, const char *);
+extern int lt_srcline(const char *, size_t, int, int *);
+extern void lt_where(lua_State *L, int container);
+
+/* Native formatters */
+extern void lt_formatters(lua_State *L);
+extern int lt_native_format(const char *, size_t, int *, int *);
+
+/* Instrumentation */
+extern lua_Integer lt_nsec(void);
+extern struct lt_stats *lt_stats(lua_State *L, int, const char *);
+extern struct lt_block_stats *lt_block_stats(lua_State *L, int,
+    const char *, const char *);
+extern void lt_push_stats(lua_State *L, int);
+extern struct lt_alloc *lt_alloc(lua_State *L);
+
+/* Output sinks */
+extern void sink_write(lua_State *L, struct lt_render *, const char *,
+    size_t);
+extern void sink_flush(lua_State *L, struct lt_render *);
+extern int sink_poll(lua_State *L, struct lt_render *, int);
+extern int sink_finish(lua_State *L, struct lt_render *, int);
+extern void sink_static(lua_State *L, struct lt_render *, int, int);
+extern int sink_compress(struct lt_render *, int);
+extern void sink_compress_end(struct lt_render *);
+
+/* File system watches */
+extern int lt_watch_start(struct render_context *);
+extern void lt_watch_stop(struct render_context *);
+extern void lt_watch_add(struct render_context *, const char *fnam,
+    const char *path);
+extern void lt_watch_drain(lua_State *L, struct render_context *,
+    int container);
 
 #endif /* __LUATEMPLATE_H__ */
@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2021 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Native template modules.  ltc -c turns a template into C source, which
+ * is built into a shared object holding the compiled code of the template
+ * and all of its literal text in one static array.  The generated code
+ * prints literals with print_literal(offset, len), a single copy from the
+ * array into the sink.  With ctx:nativeDir(dir), process_file() prefers
+ * the module dir/<template>.so over compiling the template, as long as it
+ * was built from the current file with the options of the context.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "buffer.h"
+#include "luatemplate.h"
+
+/* A module in use, with the file it was loaded from */
+struct module {
+	SLIST_ENTRY(module)	 next;
+	char			*path;
+	dev_t			 dev;
+	ino_t			 ino;
+	time_t			 mtime;
+	void			*dl;
+};
+
+static SLIST_HEAD(, module) modules = SLIST_HEAD_INITIALIZER(modules);
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Load a copy of the module at path, whose file sb describes, under a
+ * name of its own.  The name holds the inode and modification time, so
+ * that a loaded module of the same name is the same file.  The copy is
+ * removed again, while the module is loaded its inode is not reused.
+ */
+static void *
+load_copy(const char *path, struct stat *sb)
+{
+	char tmp[PATH_MAX], buf[BUFFER_SIZE];
+	const char *dir;
+	ssize_t n;
+	void *dl;
+	int in, out;
+
+	if ((dir = getenv("TMPDIR")) == NULL)
+		dir = "/tmp";
+	snprintf(tmp, sizeof tmp, "%s/lt-%jx-%jx-%jx-XXXXXX", dir,
+	    (uintmax_t)sb->st_dev, (uintmax_t)sb->st_ino,
+	    (uintmax_t)sb->st_mtime);
+	if ((in = open(path, O_RDONLY)) == -1)
+		return NULL;
+	if ((out = mkstemp(tmp)) == -1) {
+		close(in);
+		return NULL;
+	}
+	while ((n = read(in, buf, sizeof buf)) > 0)
+		if (write(out, buf, n) != n) {
+			n = -1;
+			break;
+		}
+	close(in);
+	dl = NULL;
+	if (!close(out) && n == 0)
+		dl = dlopen(tmp, RTLD_NOW | RTLD_LOCAL);
+	unlink(tmp);
+	return dl;
+}
+
+/*
+ * Open the module at path.  dlopen() returns the module loaded first
+ * under a name, even if the file was rebuilt since, so a module that was
+ * replaced is loaded from a copy.  *known is set for modules in use.
+ */
+static void *
+load(const char *path, struct stat *sb, int *known)
+{
+	struct module *mod;
+	int replaced;
+
+	*known = replaced = 0;
+	SLIST_FOREACH(mod, &modules, next) {
+		if (strcmp(mod->path, path))
+			continue;
+		if (mod->dev == sb->st_dev && mod->ino == sb->st_ino
+		    && mod->mtime == sb->st_mtime) {
+			*known = 1;
+			return mod->dl;
+		}
+		replaced = 1;
+	}
+	if (replaced)
+		return load_copy(path, sb);
+	return dlopen(path, RTLD_NOW | RTLD_LOCAL);
+}
+
+/* Remember a module that is used, it is never unloaded */
+static void
+keep(const char *path, struct stat *sb, void *dl)
+{
+	struct module *mod;
+
+	if ((mod = malloc(sizeof(struct module))) == NULL)
+		return;
+	if ((mod->path = strdup(path)) == NULL) {
+		free(mod);
+		return;
+	}
+	mod->dev = sb->st_dev;
+	mod->ino = sb->st_ino;
+	mod->mtime = sb->st_mtime;
+	mod->dl = dl;
+	SLIST_INSERT_HEAD(&modules, mod, next);
+}
+
+/* print_literal(offset, len) prints len bytes of the text of a module */
+static int
+print_literal(lua_State *L)
+{
+	struct lt_render *r;
+	const struct lt_native *m;
+	lua_Integer off, len;
+
+	r = lt_render(L, lua_touserdata(L, lua_upvalueindex(1)));
+	m = lua_touserdata(L, lua_upvalueindex(2));
+	off = luaL_checkinteger(L, 1);
+	len = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, off >= 0 && len >= 0
+	    && (size_t)off + len <= m->textlen, 1, "literal out of range");
+	sink_write(L, r, m->text + off, len);
+	return sink_poll(L, r, 0);
+}
+
+/* Run the code of a module with the container and its print_literal() */
+static int
+native_run(lua_State *L)
+{
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_insert(L, 1);
+	lua_pushvalue(L, lua_upvalueindex(2));
+	lua_call(L, lua_gettop(L) - 1, 0);
+	return 0;
+}
+
+/*
+ * Push the function creating template fnam, found at sb, from its native
+ * module and fill in its includes.  Returns -1, with nothing pushed, if
+ * there is no module that matches the file and the options.  Modules are
+ * never unloaded, their text stays in use by the code.
+ */
+int
+native_load(lua_State *L, struct render_context *ctx, const char *fnam,
+    struct stat *sb, struct lt_include_head *includes, int options)
+{
+	const struct lt_native *m;
+	char path[PATH_MAX];
+	struct stat so;
+	const char *p;
+	void *dl;
+	int known;
+
+	if (ctx->nativedir == NULL)
+		return -1;
+	snprintf(path, sizeof path, "%s/%s.so", ctx->nativedir, fnam);
+	if (stat(path, &so))
+		return -1;
+	pthread_mutex_lock(&lock);
+	if ((dl = load(path, &so, &known)) == NULL) {
+		pthread_mutex_unlock(&lock);
+		return -1;
+	}
+	if ((m = dlsym(dl, LT_NATIVE_SYMBOL)) == NULL
+	    || m->version != LT_CODE_VERSION || m->options != options
+	    || strcmp(m->fnam, fnam) || m->mtime != (long long)sb->st_mtime
+	    || m->size != (long long)sb->st_size) {
+		if (!known)
+			dlclose(dl);
+		pthread_mutex_unlock(&lock);
+		return -1;
+	}
+	if (!known)
+		keep(path, &so, dl);
+	pthread_mutex_unlock(&lock);
+
+	p = m->code;
+	if (lt_undump(L, &p, m->code + m->codelen, includes))
+		return -1;
+	lua_pushlightuserdata(L, ctx);
+	lua_pushlightuserdata(L, (void *)m);
+	lua_pushcclosure(L, print_literal, 2);
+	lua_pushcclosure(L, native_run, 2);
+	return 0;
+}
@@ -0,0 +1,326 @@
+/*
+ * Copyright (C) 2021 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Parallel warm-up.  All templates below a directory are run through the
+ * reader and dumped on a pool of threads, each with a scratch Lua state of
+ * its own.  The calling thread then loads the results into the context.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include <fts.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "buffer.h"
+#include "luatemplate.h"
+
+#define PRELOAD_MAXTHREADS	64
+
+struct job {
+	char			*fnam;
+	char			 path[PATH_MAX];
+	struct stat		 sb;
+	struct buffer		 code;	/* lt_dump() output */
+	char			*error;
+	lua_Integer		 time;	/* spent compiling, in ns */
+	int			 installed;
+	struct lt_include_head	 includes;
+};
+
+struct pool {
+	struct job		*jobs;
+	size_t			 njobs;
+	size_t			 next;
+	int			 options;	/* compile options */
+	char			**roots;	/* search path */
+	pthread_mutex_t		 mtx;
+};
+
+/* Compile one template in the scratch state L of a worker */
+static void
+compile_job(lua_State *L, struct job *job, int options, char **roots)
+{
+	struct lt_include_head includes;
+	struct lt_state s;
+	char msg[128];
+	lua_Integer start;
+
+	lt_init_includes(&includes);
+	if (lt_resolve(roots, job->fnam, job->path, sizeof job->path,
+	    &job->sb)) {
+		snprintf(msg, sizeof msg, "can't stat %s", job->fnam);
+		job->error = strdup(msg);
+		return;
+	}
+	start = lt_nsec();
+	if (lt_compile(L, job->fnam, job->path, &job->sb, &s, &includes,
+	    roots, options)) {
+		job->error = strdup(lua_tostring(L, -1));
+		lua_pop(L, 1);
+	} else {
+		if (buf_init(&job->code) || lt_dump(L, &job->code, &includes)
+		    || job->code.error)
+			job->error = strdup("memory error");
+		lua_pop(L, 1);
+	}
+	job->time = lt_nsec() - start;
+	lt_free_includes(&includes);
+}
+
+static void *
+worker(void *arg)
+{
+	struct pool *pool = arg;
+	lua_State *L;
+	size_t n;
+
+	L = luaL_newstate();
+	for (;;) {
+		pthread_mutex_lock(&pool->mtx);
+		n = pool->next++;
+		pthread_mutex_unlock(&pool->mtx);
+		if (n >= pool->njobs)
+			break;
+		if (L == NULL)
+			pool->jobs[n].error = strdup("can't create Lua state");
+		else
+			compile_job(L, &pool->jobs[n], pool->options,
+			    pool->roots);
+	}
+	if (L != NULL)
+		lua_close(L);
+	return NULL;
+}
+
+/*
+ * Name the template at path relative to the first search root it is
+ * below, the name renderFile() and includes find it under.  The empty
+ * root takes relative paths as they are, so do paths below no root.
+ */
+static const char *
+template_name(char **roots, const char *path)
+{
+	const char *root;
+	size_t len;
+
+	if (!strncmp(path, "./", 2))
+		path += 2;
+	for (roots = roots ? roots : lt_default_roots; *roots; roots++) {
+		root = *roots;
+		if (!strncmp(root, "./", 2))
+			root += 2;
+		if (*root == '\0') {
+			if (*path != '/')
+				break;
+			continue;
+		}
+		len = strlen(root);
+		while (len > 1 && root[len - 1] == '/')
+			len--;
+		if (!strncmp(path, root, len) && path[len] == '/') {
+			path += len;
+			while (*path == '/')
+				path++;
+			break;
+		}
+	}
+	return path;
+}
+
+/* Queue every .lt file below dir that is not loaded yet */
+static int
+scan(lua_State *L, int container, struct pool *pool, const char *dir)
+{
+	FTS *fts;
+	FTSENT *e;
+	char *argv[2];
+	const char *fnam;
+	struct job *jobs;
+	size_t len, size;
+	int loaded;
+
+	argv[0] = (char *)dir;
+	argv[1] = NULL;
+	if ((fts = fts_open(argv, FTS_PHYSICAL, NULL)) == NULL)
+		return -1;
+
+	size = 0;
+	lua_getfield(L, container, "template");
+	while ((e = fts_read(fts)) != NULL) {
+		if (e->fts_info != FTS_F)
+			continue;
+		len = strlen(e->fts_path);
+		if (len < 3 || strcmp(e->fts_path + len - 3, ".lt"))
+			continue;
+		fnam = template_name(pool->roots, e->fts_path);
+
+		loaded = lua_getfield(L, -1, fnam) != LUA_TNIL;
+		lua_pop(L, 1);
+		if (loaded)
+			continue;
+
+		if (pool->njobs == size) {
+			size = size ? size * 2 : 64;
+			if ((jobs = realloc(pool->jobs,
+			    size * sizeof(struct job))) == NULL)
+				goto fail;
+			pool->jobs = jobs;
+		}
+		memset(&pool->jobs[pool->njobs], 0, sizeof(struct job));
+		if ((pool->jobs[pool->njobs].fnam = strdup(fnam)) == NULL)
+			goto fail;
+		lt_init_includes(&pool->jobs[pool->njobs].includes);
+		pool->njobs++;
+	}
+	lua_pop(L, 1);
+	fts_close(fts);
+	return 0;
+fail:
+	lua_pop(L, 1);
+	fts_close(fts);
+	return -1;
+}
+
+/*
+ * Compile all templates below dir using nthreads threads and install them
+ * in the container at index container.  All templates are installed
+ * before their includes are processed, so that templates of the same
+ * preload are not compiled once more by process_includes().  Templates
+ * that fail are skipped, the first error is pushed and -1 returned.
+ */
+int
+preload(lua_State *L, struct render_context *ctx, int container,
+    const char *dir, int nthreads)
+{
+	pthread_t threads[PRELOAD_MAXTHREADS];
+	struct pool pool;
+	struct job *job, *first;
+	struct lt_stats *st;
+	const char *p;
+	size_t n;
+	int t, rv;
+
+	memset(&pool, 0, sizeof pool);
+	pool.options = LT_OPTIONS(LT_FLAGS(ctx));
+	pool.roots = ctx->roots;
+	if (scan(L, container, &pool, dir)) {
+		lua_pushfstring(L, "can't read %s", dir);
+		rv = -1;
+		goto out;
+	}
+
+	if (nthreads > PRELOAD_MAXTHREADS)
+		nthreads = PRELOAD_MAXTHREADS;
+	if ((size_t)nthreads > pool.njobs)
+		nthreads = pool.njobs;
+	pthread_mutex_init(&pool.mtx, NULL);
+	for (t = 0; t < nthreads; t++)
+		if (pthread_create(&threads[t], NULL, worker, &pool))
+			break;
+	/* Without any thread, compile everything here */
+	if (t == 0)
+		worker(&pool);
+	nthreads = t;
+	for (t = 0; t < nthreads; t++)
+		pthread_join(threads[t], NULL);
+	pthread_mutex_destroy(&pool.mtx);
+
+	first = NULL;
+	for (n = 0; n < pool.njobs; n++) {
+		job = &pool.jobs[n];
+		if (job->error == NULL) {
+			p = job->code.data;
+			if (lt_undump(L, &p, job->code.data + job->code.size,
+			    &job->includes))
+				job->error = strdup("invalid bytecode");
+			else {
+				if (ctx->cachedir != NULL)
+					cache_store(L, ctx->cachedir,
+					    job->path, job->fnam, pool.roots,
+					    &job->sb, &job->includes,
+					    pool.options);
+				if (ctx->shared)
+					store_add(L, job->path, job->fnam,
+					    pool.roots, &job->sb,
+					    &job->includes, pool.options);
+				if (lt_install(L, ctx, container, job->fnam,
+				    job->path, &job->sb)) {
+					job->error = strdup(lua_tostring(L,
+					    -1));
+					lua_pop(L, 1);
+				} else {
+					st = lt_stats(L, container, job->fnam);
+					st->compiles++;
+					st->compile_time += job->time;
+					job->installed = 1;
+				}
+			}
+		}
+		if (!job->installed && first == NULL)
+			first = job;
+	}
+
+	for (n = 0; n < pool.njobs; n++) {
+		job = &pool.jobs[n];
+		if (!job->installed)
+			continue;
+		if (process_includes(L, ctx, container, job->fnam,
+		    &job->includes)) {
+			free(job->error);
+			job->error = strdup(lua_tostring(L, -1));
+			lua_pop(L, 1);
+			if (first == NULL)
+				first = job;
+			lt_evict(L, container, job->fnam);
+		}
+	}
+
+	rv = 0;
+	if (first != NULL) {
+		lua_pushfstring(L, "%s: %s", first->fnam,
+		    first->error != NULL ? first->error : "memory error");
+		rv = -1;
+	}
+out:
+	for (n = 0; n < pool.njobs; n++) {
+		job = &pool.jobs[n];
+		free(job->fnam);
+		free(job->error);
+		buf_free(&job->code);
+		lt_free_includes(&job->includes);
+	}
+	free(pool.jobs);
+	return rv;
+}
@@ -25,12 +25,15 @@
 #include <sys/param.h>
 #include <sys/mman.h>
 #include <sys/queue.h>
+#include <sys/stat.h>
 
 #include <ctype.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #if defined(__linux__) && !defined(LIBBSD_OVERLAY)
@@ -43,6 +46,28 @@
 #include "buffer.h"
 #include "luatemplate.h"
 
+/*
+ * Generated code runs with the container as environment and keeps the
+ * helper functions in locals, so that the templates can use them without
+ * them being set in the environment passed to render_template().
+ */
+#define LT_ENV		"_ENV = ...\n"
+#define LT_LOCALS	"local print, string, render_block, render_template, escape_html, " \
+	"escape_xml, escape_url, escape_latex, cache_begin, cache_end, " \
+	"format_d, format_x, format_f, format_s, print_static, print_html, " \
+	"print_xml, print_url, print_latex = " \
+	"print, string, render_block, render_template, escape_html, " \
+	"escape_xml, escape_url, escape_latex, cache_begin, cache_end, " \
+	"format_d, format_x, format_f, format_s, print_static, print_html, " \
+	"print_xml, print_url, print_latex\n"
+#define LT_PROLOGUE	LT_ENV LT_LOCALS
+
+/* Native modules pass their print_literal() along, see native.c */
+#define LT_NATIVE_ENV	"local print_literal\n_ENV, print_literal = ...\n"
+
+/* Highest level of long brackets used for folded literals */
+#define LT_MAXLEVEL	16
+
 enum lt_states {
 	s_startup = 0,
 	s_initial,
@@ -54,715 +79,1413 @@ enum lt_states {
 	s_error
 };
 
-struct lt_escape_entity {
-	char c;
-	const char *escape;
-};
+/*
+ * Escape tables are indexed by the unsigned value of a byte, bytes that
+ * are passed through unchanged have no entry.
+ */
+#define ENTITY(s)	{ s, sizeof(s) - 1 }
 
 /* XXX Merge HTML and XML table? */
-static struct lt_escape_entity html_escape[] = {
-	{ '&',	"&amp;" },
-	{ '<',	"&lt;" },
-	{ '>',	"&gt;" },
-	{ '"',	"&#034;" },
-	{ '\'',	"&#039;" },
-	{ '\0', NULL }
+static const struct lt_entity html_escape[256] = {
+	['&'] =		ENTITY("&amp;"),
+	['<'] =		ENTITY("&lt;"),
+	['>'] =		ENTITY("&gt;"),
+	['"'] =		ENTITY("&#034;"),
+	['\''] =	ENTITY("&#039;")
 };
 
-static struct lt_escape_entity xml_escape[] = {
-	{ '&',	"&amp;" },
-	{ '<',	"&lt;" },
-	{ '>',	"&gt;" },
-	{ '"',	"&quot;" },
-	{ '\'',	"&apos;" },
-	{ '\0', NULL }
+static const struct lt_entity xml_escape[256] = {
+	['&'] =		ENTITY("&amp;"),
+	['<'] =		ENTITY("&lt;"),
+	['>'] =		ENTITY("&gt;"),
+	['"'] =		ENTITY("&quot;"),
+	['\''] =	ENTITY("&apos;")
 };
 
-static struct lt_escape_entity latex_escape[] = {
-	{ '&',	"\\&" },
-	{ '$',	"\\$" },
-	{ '\\',	"$\\backslash$" },
-	{ '_',	"\\_" },
-	{ '<',	"$<$" },
-	{ '>',	"$>$" },
-	{ '%',	"\\%" },
-	{ '#',	"\\#" },
-	{ '^',	"$^$" },
-	{ '\0', NULL }
+static const struct lt_entity latex_escape[256] = {
+	['&'] =		ENTITY("\\&"),
+	['$'] =		ENTITY("\\$"),
+	['\\'] =	ENTITY("$\\backslash$"),
+	['_'] =		ENTITY("\\_"),
+	['<'] =		ENTITY("$<$"),
+	['>'] =		ENTITY("$>$"),
+	['%'] =		ENTITY("\\%"),
+	['#'] =		ENTITY("\\#"),
+	['^'] =		ENTITY("$^$")
 };
 
-static struct lt_escape_entity url_escape[] = {
-	{ ' ',	"%20"},
-	{ '<',	"%3C"},
-	{ '>',	"%3E"},
-	{ '#',	"%23"},
-	{ '%',	"%25"},
-	{ '{',	"%7B"},
-	{ '}',	"%7D"},
-	{ '|',	"%7C"},
-	{ '\\',	"%5C"},
-	{ '^',	"%5E"},
-	{ '~',	"%7E"},
-	{ '[',	"%5B"},
-	{ ']',	"%5D"},
-	{ '`',	"%60"},
-	{ ';',	"%3B"},
-	{ '/',	"%2F"},
-	{ '?',	"%3F"},
-	{ ':',	"%3A"},
-	{ '@',	"%40"},
-	{ '=',	"%3D"},
-	{ '&',	"%26"},
-	{ '$',	"%24"},
-	{ '\0',	NULL }
+static const struct lt_entity url_escape[256] = {
+	[' '] =		ENTITY("%20"),
+	['<'] =		ENTITY("%3C"),
+	['>'] =		ENTITY("%3E"),
+	['#'] =		ENTITY("%23"),
+	['%'] =		ENTITY("%25"),
+	['{'] =		ENTITY("%7B"),
+	['}'] =		ENTITY("%7D"),
+	['|'] =		ENTITY("%7C"),
+	['\\'] =	ENTITY("%5C"),
+	['^'] =		ENTITY("%5E"),
+	['~'] =		ENTITY("%7E"),
+	['['] =		ENTITY("%5B"),
+	[']'] =		ENTITY("%5D"),
+	['`'] =		ENTITY("%60"),
+	[';'] =		ENTITY("%3B"),
+	['/'] =		ENTITY("%2F"),
+	['?'] =		ENTITY("%3F"),
+	[':'] =		ENTITY("%3A"),
+	['@'] =		ENTITY("%40"),
+	['='] =		ENTITY("%3D"),
+	['&'] =		ENTITY("%26"),
+	['$'] =		ENTITY("%24")
 };
 
-const char *
-lt_escape(int escape, char c)
+const struct lt_entity *
+lt_escape_table(int escape)
 {
-	struct lt_escape_entity *esc;
-
 	switch (escape) {
 	case e_html:
-		esc = html_escape;
-		break;
+		return html_escape;
 	case e_xml:
-		esc = xml_escape;
-		break;
+		return xml_escape;
 	case e_url:
-		esc = url_escape;
-		break;
+		return url_escape;
 	case e_latex:
-		esc = latex_escape;
-		break;
+		return latex_escape;
 	default:
 		return NULL;
 	}
+}
+
+/*
+ * Return the length of the initial run of s that needs no escaping, so
+ * that it can be copied as a whole.
+ */
+size_t
+lt_escape_span(const struct lt_entity *esc, const char *s, size_t len)
+{
+	const unsigned char *p, *end;
 
-	for (; esc->escape != NULL; esc++)
-		if (esc->c == c)
+	p = (const unsigned char *)s;
+	end = p + len;
+	while (end - p >= 4) {
+		if (esc[p[0]].len || esc[p[1]].len || esc[p[2]].len
+		    || esc[p[3]].len)
 			break;
-	return esc->escape;
+		p += 4;
+	}
+	while (p < end && !esc[*p].len)
+		p++;
+	return p - (const unsigned char *)s;
 }
 
-#ifdef LT_DEBUG
-void
-lt_pusherrmsg(lua_State *L, struct lt_state *s)
+const char *
+lt_escape(int escape, char c)
 {
-	static char errmsg[256];
-	char *errstr, *p, *fnam;
-	int n, lline, tline;
+	const struct lt_entity *esc;
 
-	snprintf(errmsg, sizeof(errmsg), "unknown error");
+	if ((esc = lt_escape_table(escape)) == NULL)
+		return NULL;
+	return esc[(unsigned char)c].escape;
+}
 
-	errstr = strdup(lua_tostring(L, -1));
-	if (!errstr)
-		return;
 
-	fnam = strchr(errstr, '"');
-	if (!fnam)
-		goto out_1;
+/* Milliseconds on the monotonic clock, used to throttle revalidation */
+lua_Integer
+lt_msec(void)
+{
+	struct timespec ts;
 
-	fnam++;
-	p = strchr(fnam, '"');
-	if (!p)
-		goto out_1;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (lua_Integer)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-	*p++ = '\0';
-	lline = 0;
-	if ((p = strchr(p, ':')))
-		lline = atoi(++p);
-	else
-		goto out_1;
+/*
+ * The templates a template includes or extends are kept in a set, whose
+ * buckets double whenever it holds as many templates.  A zeroed set is
+ * empty.
+ */
+#define LT_INCLUDE_BUCKETS	16	/* to start with */
 
-	p = strchr(p, ':');
-	if (!p)
-		goto out_1;
-	p++;
+void
+lt_init_includes(struct lt_include_head *includes)
+{
+	memset(includes, 0, sizeof(struct lt_include_head));
+}
 
-	tline = 0;
-	for (n = 0; s->lines[n]; n++) {
-		if (s->lines[n] >= lline)
-			break;
-		tline++;
-	}
+/* Find fnam in a set of included templates, comparing the hashes first */
+struct lt_include *
+lt_find_include(struct lt_include_head *includes, const char *fnam)
+{
+	struct lt_include *include;
+	uint64_t hash;
 
-	snprintf(errmsg, sizeof(errmsg), "[template \"%s\"]:%d:%s",
-	    fnam, tline, p);
-	lua_pushstring(L, errmsg);
-out_1:
-	free(errstr);
+	if (includes->nbuckets == 0)
+		return NULL;
+	hash = lt_hash(fnam, strlen(fnam));
+	for (include = includes->bucket[hash % includes->nbuckets];
+	    include != NULL; include = include->chain)
+		if (include->hash == hash && !strcmp(include->fnam, fnam))
+			return include;
+	return NULL;
 }
 
-const char *
-lt_errmsg(lua_State *L)
+/* Double the buckets of a set, chains just get longer if that fails */
+static int
+rehash(struct lt_include_head *includes)
 {
-	static char errmsg[256];
-	char *errstr, *p, *fnam;
-	int lline, tline, t;
+	struct lt_include **bucket, *include;
+	size_t n;
 
-	snprintf(errmsg, sizeof(errmsg), "unknown error");
+	n = includes->nbuckets > 0 ? includes->nbuckets * 2
+	    : LT_INCLUDE_BUCKETS;
+	if ((bucket = calloc(n, sizeof(struct lt_include *))) == NULL)
+		return includes->nbuckets > 0 ? 0 : -1;
+	SLIST_FOREACH(include, &includes->list, next) {
+		include->chain = bucket[include->hash % n];
+		bucket[include->hash % n] = include;
+	}
+	free(includes->bucket);
+	includes->bucket = bucket;
+	includes->nbuckets = n;
+	return 0;
+}
 
-	errstr = strdup(lua_tostring(L, -1));
-	if (!errstr)
-		goto out_2;
+/*
+ * Add fnam to a set of included templates, unless it is already there.
+ * Returns NULL if memory is exhausted.
+ */
+struct lt_include *
+lt_add_include(struct lt_include_head *includes, const char *fnam)
+{
+	struct lt_include *include;
+	size_t n;
 
-	fnam = strchr(errstr, '"');
-	if (!fnam)
-		goto out_1;
+	if ((include = lt_find_include(includes, fnam)) != NULL)
+		return include;
+	if (includes->count >= includes->nbuckets && rehash(includes))
+		return NULL;
+	if ((include = malloc(sizeof(struct lt_include))) == NULL)
+		return NULL;
+	if ((include->fnam = strdup(fnam)) == NULL) {
+		free(include);
+		return NULL;
+	}
+	include->hash = lt_hash(fnam, strlen(fnam));
+	include->mtime = include->size = 0;
+	n = include->hash % includes->nbuckets;
+	include->chain = includes->bucket[n];
+	includes->bucket[n] = include;
+	SLIST_INSERT_HEAD(&includes->list, include, next);
+	includes->count++;
+	return include;
+}
 
-	fnam++;
-	p = strchr(fnam, '"');
-	if (!p)
-		goto out_1;
+/* Empty a set of included templates, which can be used again */
+void
+lt_free_includes(struct lt_include_head *includes)
+{
+	struct lt_include *include;
 
-	*p++ = '\0';
-	lline = 0;
-	if ((p = strchr(p, ':')))
-		lline = atoi(++p);
-	else
-		goto out_1;
-
-	p = strchr(p, ':');
-	if (!p)
-		goto out_1;
-	p++;
-
-	lua_getglobal(L, "lt");
-	lua_pushstring(L, fnam);
-	lua_gettable(L, -2);
-	lua_pushstring(L, "lines");
-	lua_gettable(L, -2);
-	t = lua_gettop(L);
-	lua_pushnil(L);
-	tline = 1;
-	while (lua_next(L, t)) {
-		if (lua_tointeger(L, -1) >= lline) {
-			lua_pop(L, 1);
-			break;
-		}
-		tline++;
-		lua_pop(L, 1);
+	while (!SLIST_EMPTY(&includes->list)) {
+		include = SLIST_FIRST(&includes->list);
+		SLIST_REMOVE_HEAD(&includes->list, next);
+		free(include->fnam);
+		free(include);
 	}
+	free(includes->bucket);
+	lt_init_includes(includes);
+}
 
-	lua_pop(L, 3);
-
-	snprintf(errmsg, sizeof(errmsg), "[template \"%s\"]:%d:%s",
-	    fnam, tline, p);
+/*
+ * Replace the generated Lua code on top of the stack by the compiled
+ * function, named after the template.  On error, the code is replaced by
+ * an error message.
+ */
+static int
+load_chunk(lua_State *L, const char *fnam, struct lt_state *s)
+{
+	const char *buff;
+	size_t len;
 
-out_1:
-	free(errstr);
-out_2:
-	return errmsg;
+	buff = lua_tolstring(L, -1, &len);
+	switch (luaL_loadbuffer(L, buff, len, fnam)) {
+	case LUA_OK:
+		lua_remove(L, -2);
+		return 0;
+	case LUA_ERRSYNTAX:
+		srcmap_remap(L, s, fnam);
+		lua_pushfstring(L, "syntax error: %s", lua_tostring(L, -1));
+		break;
+	case LUA_ERRMEM:
+		lua_pushstring(L, "memory error");
+		break;
+	default:
+		lua_pushstring(L, "unknown load error");
+		break;
+	}
+	lua_remove(L, -2);
+	return -1;
 }
-#endif
+
+/* Without a search path, a file in custom/ takes precedence */
+char *lt_default_roots[] = { "custom", "", NULL };
 
 /*
- * lt_process is required in addition to lt_reader to process include
- * directives and to detect recursion.
+ * Find the file for template fnam in the first of the NULL terminated
+ * roots that has it, the empty root is the current directory.  If roots
+ * is NULL, lt_default_roots is used.  Absolute names are not searched.
  */
 int
-process_file(lua_State *L, const char *fnam, struct lt_include_head *ihead,
-    int print)
+lt_resolve(char **roots, const char *fnam, char *path, size_t len,
+    struct stat *sb)
 {
-	struct stat sb;
-	struct lt_include *include, *cg;
-	struct lt_state s;
-	int fd, errval;
-	char errmsg[BUFSIZ];
-	char path[PATH_MAX];
-	char *buf;
-#ifdef LT_DEBUG
-	int n;
-#endif
-	const char *buff;
-	size_t len;
-	struct lt_include_head includes;
+	if (*fnam == '/') {
+		strlcpy(path, fnam, len);
+		return stat(path, sb) ? -1 : 0;
+	}
+	for (roots = roots ? roots : lt_default_roots; *roots; roots++) {
+		if (**roots == '\0')
+			strlcpy(path, fnam, len);
+		else
+			snprintf(path, len, "%s/%s", *roots, fnam);
+		if (!stat(path, sb))
+			return 0;
+	}
+	return -1;
+}
 
-	snprintf(path, sizeof path, "custom/%s", fnam);
-	if (stat(path, &sb)) {
-		strncpy(path, fnam, sizeof path);
+/*
+ * Like lt_resolve() on the search path of ctx, with the results kept in
+ * the resolved table of the container at index container.  A path found
+ * is only checked to still exist.  That none was found is remembered for
+ * the revalidation interval.
+ */
+static int
+lookup(lua_State *L, struct render_context *ctx, int container,
+    const char *fnam, char *path, size_t len, struct stat *sb)
+{
+	int rv, type;
 
-		if (stat(path, &sb)) {
-			snprintf(errmsg, sizeof errmsg, "can't stat %s", fnam);
-			lua_pushstring(L, errmsg);
-			return -1;
+	lua_getfield(L, container, "resolved");
+	type = lua_getfield(L, -1, fnam);
+	if (type == LUA_TSTRING) {
+		strlcpy(path, lua_tostring(L, -1), len);
+		if (!stat(path, sb)) {
+			lua_pop(L, 2);
+			return 0;
 		}
+	} else if (type == LUA_TNUMBER
+	    && lt_msec() - lua_tointeger(L, -1) < ctx->revalidate) {
+		lua_pop(L, 2);
+		return -1;
 	}
+	lua_pop(L, 1);
 
-	if (print)
-		printf("processing template %s\n", path);
+	if ((rv = lt_resolve(ctx->roots, fnam, path, len, sb)))
+		lua_pushinteger(L, lt_msec());
+	else
+		lua_pushstring(L, path);
+	lua_setfield(L, -2, fnam);
+	lua_pop(L, 1);
+	return rv;
+}
+
+/* Run the template text at p through the reader and load the result */
+static int
+compile(lua_State *L, const char *fnam, const char *p, size_t len,
+    struct lt_state *s, struct lt_include_head *includes, char **roots,
+    int flags)
+{
+	int rv;
+
+	if (reader(L, p, len, s, includes, roots, fnam, flags))
+		return -1;
+	rv = load_chunk(L, fnam, s);
+	srcmap_free(s);
+	return rv;
+}
+
+/*
+ * Run the template at path through the reader and push the compiled
+ * function, which creates the template entry and its blocks.  Inlined
+ * includes are looked up in roots.
+ */
+int
+lt_compile(lua_State *L, const char *fnam, const char *path,
+    struct stat *sb, struct lt_state *s, struct lt_include_head *includes,
+    char **roots, int flags)
+{
+	int fd, rv;
+	char *buf;
+
+	/* The reader is length bounded, an empty file needs no mapping */
+	if (sb->st_size == 0)
+		return compile(L, fnam, "", 0, s, includes, roots, flags);
 
 	if ((fd = open(path, O_RDONLY)) == -1) {
-		snprintf(errmsg, sizeof errmsg, "can't open %s", fnam);
-		lua_pushstring(L, errmsg);
+		lua_pushfstring(L, "can't open %s", fnam);
 		return -1;
 	}
 
-	if ((buf = mmap(0, sb.st_size, PROT_READ,
+	if ((buf = mmap(0, sb->st_size, PROT_READ,
 	    MAP_PRIVATE | MAP_FILE, fd, (off_t)0L)) == MAP_FAILED) {
-		snprintf(errmsg, sizeof errmsg, "can't mmap %s", fnam);
-		lua_pushstring(L, errmsg);
+		lua_pushfstring(L, "can't mmap %s", fnam);
 		close(fd);
 		return -1;
 	}
 
-	SLIST_INIT(&includes);
-#ifdef LT_DEBUG
-	s.tline = 0;
-	s.lline = 0;
-	s.linemax = LINEBUFSIZ;
-	s.lines = calloc(s.linemax, sizeof(int));
-#endif
-	include = malloc(sizeof(struct lt_include));
-	include->fnam = strdup(fnam);
-	SLIST_INSERT_HEAD(ihead, include, next);
+	rv = compile(L, fnam, buf, sb->st_size, s, includes, roots, flags);
 
-	reader(L, buf, &s, &includes, fnam, print);
-	buff = lua_tolstring(L, -1, &len);
-	if ((errval = luaL_loadbuffer(L, buff, len, fnam))) {
-		switch (errval) {
-		case LUA_ERRSYNTAX:
-			lua_pushstring(L, "syntax error");
-			break;
-		case LUA_ERRMEM:
-			lua_pushstring(L, "memory error");
-			break;
-		default:
-			lua_pushstring(L, "unknown load error");
+	munmap(buf, sb->st_size);
+	close(fd);
+	return rv;
+}
+
+/* Like lt_compile(), but for a template held in memory */
+int
+lt_compile_string(lua_State *L, const char *fnam, const char *source,
+    size_t len, struct lt_state *s, struct lt_include_head *includes,
+    char **roots, int flags)
+{
+	return compile(L, fnam, source, len, s, includes, roots, flags);
+}
+
+/* Run the compiled template on top of the stack with the container */
+int
+lt_run(lua_State *L, int container)
+{
+	lua_pushvalue(L, container);
+	return lua_pcall(L, 1, 0, 0) ? -1 : 0;
+}
+
+/*
+ * Check whether a template inlined by the compiled template on top of the
+ * stack, which came from a cache, changed since.  If so, the template is
+ * dropped together with its includes, so that it is compiled again.
+ */
+static int
+stale(lua_State *L, struct render_context *ctx, int container,
+    struct lt_include_head *includes)
+{
+	struct lt_include *include;
+	struct stat sb;
+	char path[PATH_MAX];
+
+	SLIST_FOREACH(include, &includes->list, next)
+		if (include->mtime != 0 && (lookup(L, ctx, container,
+		    include->fnam, path, sizeof path, &sb)
+		    || sb.st_mtime != include->mtime
+		    || sb.st_size != include->size))
 			break;
-		}
-		printf("error loading: %s\n", lua_tostring(L, -1));
-	}
-	lua_pushvalue(L, -4);
-	if (lua_pcall(L, 1, 0, 0))
-		printf("an error occured: %s\n", lua_tostring(L, -1));
+	if (include == NULL)
+		return 0;
 	lua_pop(L, 1);
+	lt_free_includes(includes);
+	return 1;
+}
 
-	buff = lua_tolstring(L, -1, &len);
-	if ((errval = luaL_loadbuffer(L, buff, len, fnam))) {
-		switch (errval) {
-		case LUA_ERRSYNTAX:
-			lua_pushstring(L, "syntax error");
-			break;
-		case LUA_ERRMEM:
-			lua_pushstring(L, "memory error");
-			break;
-		default:
-			lua_pushstring(L, "unknown load error");
-			break;
+
+/*
+ * Process the templates of the set at index 2 that are not loaded yet,
+ * in the container at index 4.  The templates being processed are the
+ * keys of the table at index 3.  Returns an error message, or nothing.
+ */
+static int
+process_all(lua_State *L)
+{
+	struct render_context *ctx;
+	struct lt_include_head *includes;
+	struct lt_include *include;
+	int missing;
+
+	ctx = lua_touserdata(L, 1);
+	includes = lua_touserdata(L, 2);
+	SLIST_FOREACH(include, &includes->list, next) {
+		if (lua_getfield(L, 3, include->fnam) != LUA_TNIL) {
+			lua_pushfstring(L, "recursion detected: %s",
+			    include->fnam);
+			return 1;
 		}
-		printf("error loading: %s\n", lua_tostring(L, -1));
+		lua_pop(L, 1);
+		lua_getfield(L, 4, "template");
+		missing = lua_getfield(L, -1, include->fnam) == LUA_TNIL;
+		lua_pop(L, 2);
+		if (missing && process_file(L, ctx, include->fnam))
+			return 1;
 	}
-	lua_pushvalue(L, -3);
-	if (lua_pcall(L, 1, 0, 0))
-		printf("an error occured: %s\n", lua_tostring(L, -1));
-	lua_pop(L, 1);
+	return 0;
+}
 
-	munmap(buf, sb.st_size);
-	close(fd);
+/*
+ * Remember what the freshly run template fnam depends on, and the mtime
+ * of what it inlined, so that it can be revalidated without compiling it
+ * again, and process the templates it includes or extends that are not
+ * loaded yet.  That runs protected, so that fnam is taken off the
+ * templates being processed even if it raises an error, which is
+ * returned like the others.
+ */
+int
+process_includes(lua_State *L, struct render_context *ctx, int container,
+    const char *fnam, struct lt_include_head *includes)
+{
+	struct lt_include *include;
+	int n, rv;
 
-#ifdef LT_DEBUG
-	if (s.lines) {
-		lua_getfield(L, -1, "template");
-		lua_getfield(L, -1, fnam);
-		lua_newtable(L);
-		for (n = 0; n < s.linemax && s.lines[n]; n++) {
-			lua_pushinteger(L, n + 1);
-			lua_pushinteger(L, s.lines[n]);
-			lua_settable(L, -3);
+	lua_getfield(L, container, "template");
+	lua_getfield(L, -1, fnam);
+	lua_pushinteger(L, lt_msec());
+	lua_setfield(L, -2, "checked");
+	lua_newtable(L);
+	n = 0;
+	SLIST_FOREACH(include, &includes->list, next) {
+		lua_pushstring(L, include->fnam);
+		lua_rawseti(L, -2, ++n);
+	}
+	lua_setfield(L, -2, "deps");
+	lua_newtable(L);
+	SLIST_FOREACH(include, &includes->list, next)
+		if (include->mtime != 0) {
+			lua_pushinteger(L, include->mtime);
+			lua_setfield(L, -2, include->fnam);
 		}
-		lua_setfield(L, -2, "lines");
-		lua_pop(L, 2);
-		free(s.lines);
+	lua_setfield(L, -2, "imtime");
+	lua_pop(L, 2);
+
+	/* The templates being processed, to detect recursion */
+	lua_getfield(L, container, "processing");
+	lua_pushboolean(L, 1);
+	lua_setfield(L, -2, fnam);
+	lua_pushcfunction(L, process_all);
+	lua_pushlightuserdata(L, ctx);
+	lua_pushlightuserdata(L, includes);
+	lua_pushvalue(L, -4);
+	lua_pushvalue(L, container);
+	rv = lua_pcall(L, 4, 1, 0);
+	lua_pushnil(L);
+	lua_setfield(L, -3, fnam);
+	if (rv != LUA_OK || !lua_isnil(L, -1)) {
+		lua_remove(L, -2);
+		return -1;
 	}
-#endif
+	lua_pop(L, 2);
+	return 0;
+}
+
+/*
+ * Run the compiled template fnam, which came from the file at path, and
+ * remember where it came from.
+ */
+int
+lt_install(lua_State *L, struct render_context *ctx, int container,
+    const char *fnam, const char *path, struct stat *sb)
+{
+	if (lt_run(L, container))
+		return -1;
+
+	lua_getfield(L, container, "template");
+	lua_getfield(L, -1, fnam);
+	lua_pushstring(L, path);
+	lua_setfield(L, -2, "path");
+	lua_pushinteger(L, sb->st_mtime);
+	lua_setfield(L, -2, "mtime");
+	lua_pushinteger(L, sb->st_size);
+	lua_setfield(L, -2, "size");
+	lua_pop(L, 2);
+	lt_touch(L, ctx, container, fnam);
+	if (ctx->wfd != -1)
+		lt_watch_add(ctx, fnam, path);
+	return 0;
+}
+
+/*
+ * lt_process is required in addition to lt_reader to process include
+ * directives and to detect recursion.  The container must be on top of
+ * the stack.  On error, a message is pushed and -1 is returned.
+ */
+int
+process_file(lua_State *L, struct render_context *ctx, const char *fnam)
+{
+	struct stat sb;
+	struct lt_include_head includes;
+	struct lt_state s;
+	struct lt_stats *st;
+	char path[PATH_MAX];
+	lua_Integer start;
+	int container, flags, rv;
 
-	if (errval)
+	container = lua_gettop(L);
+	if (lookup(L, ctx, container, fnam, path, sizeof path, &sb)) {
+		lua_pushfstring(L, "can't stat %s", fnam);
 		return -1;
+	}
 
-	SLIST_FOREACH(include, &includes, next) {
-		SLIST_FOREACH(cg, ihead, next)
-			if (!strcmp(cg->fnam, include->fnam)) {
-				snprintf(errmsg, sizeof errmsg,
-				    "recursion detected: %s", cg->fnam);
-				lua_pushstring(L, errmsg);
-				return -1;
-			}
+	lt_init_includes(&includes);
+	flags = LT_FLAGS(ctx);
+	rv = -1;
 
-		lua_getfield(L, -1, "template");
-		lua_getfield(L, -1, include->fnam);
-		errval = lua_isnil(L, -1);
-		lua_pop(L, 2);
+	start = lt_nsec();
+	if (!native_load(L, ctx, fnam, &sb, &includes, LT_OPTIONS(flags))
+	    && !stale(L, ctx, container, &includes)) {
+		if (ctx->debug)
+			printf("loading template %s from its native module\n",
+			    path);
+	} else if (ctx->shared && !store_load(L, path, fnam, ctx->roots, &sb,
+	    &includes, LT_OPTIONS(flags))
+	    && !stale(L, ctx, container, &includes)) {
+		if (ctx->debug)
+			printf("loading template %s from the store\n", path);
+	} else if (ctx->cachedir != NULL
+	    && !cache_load(L, ctx->cachedir, path, fnam, ctx->roots, &sb,
+	    &includes, LT_OPTIONS(flags))
+	    && !stale(L, ctx, container, &includes)) {
+		if (ctx->debug)
+			printf("loading template %s from cache\n", path);
+		if (ctx->shared)
+			store_add(L, path, fnam, ctx->roots, &sb, &includes,
+			    LT_OPTIONS(flags));
+	} else {
+		if (ctx->debug)
+			printf("processing template %s\n", path);
+		if (lt_compile(L, fnam, path, &sb, &s, &includes, ctx->roots,
+		    flags))
+			goto out;
+		if (ctx->cachedir != NULL)
+			cache_store(L, ctx->cachedir, path, fnam, ctx->roots,
+			    &sb, &includes, LT_OPTIONS(flags));
+		if (ctx->shared)
+			store_add(L, path, fnam, ctx->roots, &sb, &includes,
+			    LT_OPTIONS(flags));
+	}
+
+	if (lt_install(L, ctx, container, fnam, path, &sb))
+		goto fail;
+	st = lt_stats(L, container, fnam);
+	st->compiles++;
+	st->compile_time += lt_nsec() - start;
+
+	rv = process_includes(L, ctx, container, fnam, &includes);
+
+fail:
+	/* Do not leave a half processed template behind */
+	if (rv)
+		lt_evict(L, container, fnam);
+out:
+	lt_free_includes(&includes);
+	return rv;
+}
+
+/*
+ * Compile the template fnam from source, which hashes to hash, and
+ * process its includes like process_file() does.  The hash is kept with
+ * the template, so that it is only compiled again when source changes.
+ */
+int
+process_string(lua_State *L, struct render_context *ctx, const char *fnam,
+    const char *source, size_t len, lua_Integer hash)
+{
+	struct lt_include_head includes;
+	struct lt_state s;
+	struct lt_stats *st;
+	lua_Integer start;
+	int container, rv;
+
+	container = lua_gettop(L);
+	lt_init_includes(&includes);
+	rv = -1;
+
+	start = lt_nsec();
+	if (ctx->debug)
+		printf("processing template %s from memory\n", fnam);
+	if (lt_compile_string(L, fnam, source, len, &s, &includes,
+	    ctx->roots, LT_FLAGS(ctx)))
+		goto out;
+
+	if (lt_run(L, container))
+		goto fail;
+	st = lt_stats(L, container, fnam);
+	st->compiles++;
+	st->compile_time += lt_nsec() - start;
+
+	lua_getfield(L, container, "template");
+	lua_getfield(L, -1, fnam);
+	lua_pushinteger(L, hash);
+	lua_setfield(L, -2, "hash");
+	lua_pushinteger(L, len);
+	lua_setfield(L, -2, "size");
+	lua_pop(L, 2);
+	lt_touch(L, ctx, container, fnam);
+
+	rv = process_includes(L, ctx, container, fnam, &includes);
 
-		if (errval) {
-			errval = process_file(L, include->fnam, ihead, print);
-			if (errval)
-				return errval;
+fail:
+	if (rv)
+		lt_evict(L, container, fnam);
+out:
+	lt_free_includes(&includes);
+	return rv;
+}
+
+
+/* Whether the text at p, which ends at pe, starts with the literal s */
+#define MATCH(p, pe, s)	((size_t)((pe) - (p)) >= sizeof(s) - 1 \
+	&& !memcmp((p), (s), sizeof(s) - 1))
+
+/* Find the two character delimiter c1 c2 at or after p, or return pe */
+static const char *
+find(const char *p, const char *pe, char c1, char c2)
+{
+	while ((p = memchr(p, c1, pe - p)) != NULL) {
+		if (p + 1 < pe && p[1] == c2)
+			return p;
+		p++;
+	}
+	return pe;
+}
+
+static const char *
+skip_space(const char *p, const char *pe)
+{
+	while (p < pe && isspace((unsigned char)*p))
+		p++;
+	return p;
+}
+
+/*
+ * Check for the trim marker of <%- at p, just after the <%.  It must be
+ * followed by a space, = or !, so that <%-- comment %> stays a comment.
+ */
+static int
+open_trim(const char *p, const char *pe)
+{
+	return pe - p >= 2 && p[0] == '-' && (isspace((unsigned char)p[1])
+	    || p[1] == '=' || p[1] == '!');
+}
+
+/*
+ * Get the template or block name of an instruction, quoted or up to the
+ * next space or the end of the instruction, and return what follows it.
+ */
+static const char *
+get_name(const char *p, const char *pe, char *name, size_t size)
+{
+	size_t n;
+
+	n = 0;
+	p = skip_space(p, pe);
+	if (p < pe && (*p == '"' || *p == '\'')) {
+		for (p++; p < pe && *p != '"' && *p != '\''; p++)
+			if (n < size - 1)
+				name[n++] = *p;
+	} else {
+		for (; p < pe && !isspace((unsigned char)*p)
+		    && !MATCH(p, pe, "%>") && !MATCH(p, pe, "-%>"); p++)
+			if (n < size - 1)
+				name[n++] = *p;
+	}
+	name[n] = '\0';
+	return p;
+}
+
+/*
+ * Copy the text at p up to the delimiter c1 c2, or the end of the
+ * template, to b in one go and return a pointer to the delimiter.  The
+ * reader loop has already looked at the first character.
+ */
+static const char *
+copy_run(struct buffer *b, const char *p, const char *pe, char c1, char c2)
+{
+	const char *q;
+
+	q = find(p, pe, c1, c2);
+	buf_addlstring(b, p, q - p);
+	return q;
+}
+
+/*
+ * Put the literal text from p to pe into text, without the whitespace at
+ * its start after a -%> and at its end before a <%-.  When minifying,
+ * whitespace runs collapse to a newline if they span lines, otherwise to
+ * a space, and text that is only whitespace spanning lines is dropped.
+ */
+static void
+literal(struct buffer *text, const char *p, const char *pe, int ltrim,
+    int rtrim, int minify)
+{
+	const char *q;
+	int nl;
+
+	text->size = 0;
+	if (ltrim)
+		p = skip_space(p, pe);
+	if (rtrim)
+		while (pe > p && isspace((unsigned char)pe[-1]))
+			pe--;
+	if (!minify) {
+		buf_addlstring(text, p, pe - p);
+		return;
+	}
+	if (skip_space(p, pe) == pe && memchr(p, '\n', pe - p) != NULL)
+		return;
+	while (p < pe) {
+		if (!isspace((unsigned char)*p)) {
+			for (q = p; q < pe && !isspace((unsigned char)*q); q++)
+				;
+			buf_addlstring(text, p, q - p);
+		} else {
+			for (q = p, nl = 0; q < pe
+			    && isspace((unsigned char)*q); q++)
+				if (*q == '\n')
+					nl = 1;
+			buf_addchar(text, nl ? '\n' : ' ');
 		}
+		p = q;
+	}
+}
+
+/*
+ * Check for the trim marker of -%> at p, the end of a tag whose contents
+ * start at tag.  If the marker was copied to b, it is removed again.  The
+ * -- that starts a <%--%> comment is no marker.
+ */
+static int
+trim_mark(struct buffer *b, const char *tag, const char *p)
+{
+	if (p - 1 < tag || p[-1] != '-' || (*tag == '-' && p - 1 < tag + 2))
+		return 0;
+	if (b != NULL && b->size > 0 && b->data[b->size - 1] == '-')
+		b->size--;
+	return 1;
+}
+
+/* Check whether close occurs in text followed by close, except at the end */
+static int
+occurs(const char *text, size_t len, const char *close, size_t clen)
+{
+	const char *q;
+	size_t i, n;
+
+	for (q = text; (q = memchr(q, ']', len - (q - text))) != NULL; q++) {
+		for (i = q - text, n = 0; n < clen; n++, i++)
+			if ((i < len ? text[i] : close[i - len]) != close[n])
+				break;
+		if (n == clen)
+			return 1;
 	}
-	SLIST_REMOVE_HEAD(ihead, next);
 	return 0;
 }
 
-const char *
-reader(lua_State *L, char *p, struct lt_state *s,
-    struct lt_include_head *includes, const char *template, int print)
+/*
+ * Append text as a Lua long string with a level that can't be confused
+ * with its contents.  Lua skips the newline after the opening bracket.
+ */
+static void
+add_literal(struct buffer *b, const char *text, size_t len)
 {
-	struct lt_include *include;
-	int exists, n, escape, local, state, extends, block, output, cb;
-	char fnam[MAXPATHLEN];
-	struct buffer body, blocks, *b;
+	char close[LT_MAXLEVEL + 2];
+	int level;
+
+	for (level = 0;; level++) {
+		close[0] = ']';
+		memset(close + 1, '=', level);
+		close[level + 1] = ']';
+		if (level == LT_MAXLEVEL || !occurs(text, len, close, level + 2))
+			break;
+	}
+	buf_addchar(b, '[');
+	buf_addlstring(b, close + 1, level);
+	buf_addstring(b, "[\n");
+	buf_addlstring(b, text, len);
+	buf_addlstring(b, close, level + 2);
+}
+
+/*
+ * Add a run of literal text, as it ends up in the output when the
+ * generated code prints it as long string, to lit.  Like Lua does, a line
+ * break at its start is skipped and \r\n, \n\r and \r become \n.
+ */
+static void
+add_run(struct buffer *lit, const char *p, size_t len)
+{
+	const char *start, *pe, *q;
 
-	buf_init(&body);
-	buf_init(&blocks);
-	b = &body;
+	start = p;
+	pe = p + len;
+	while (p < pe) {
+		for (q = p; q < pe && *q != '\n' && *q != '\r'; q++)
+			;
+		buf_addlstring(lit, p, q - p);
+		if (q == pe)
+			break;
+		if (q > start)
+			buf_addchar(lit, '\n');
+		if (q + 1 < pe && (q[1] == '\n' || q[1] == '\r') && q[1] != *q)
+			q++;
+		p = q + 1;
+	}
+}
 
-	buf_addstring(b, "_ENV = ...\n"
-		    "template['");
-	buf_addstring(b, template);
-	buf_addstring(b, "'] = { blk = {} }\ntemplate['");
-	buf_addstring(b, template);
-	buf_addstring(b, "'].main = function(_ENV, _t)\n");
+/*
+ * Add the literal text of the reader to the text of a native module and
+ * print it from there.
+ */
+static void
+native_literal(struct buffer *b, struct buffer *literals, struct buffer *text)
+{
+	char call[64];
+	size_t off;
 
-	buf_addstring(&blocks, "_ENV = ...\n");
+	off = literals->size;
+	add_run(literals, text->data, text->size);
+	if (literals->size == off)
+		return;
+	snprintf(call, sizeof call, "print_literal(%zu, %zu)\n", off,
+	    literals->size - off);
+	buf_addstring(b, call);
+}
 
-#ifdef LT_DEBUG
-	s->tline = 0;
-	s->lline = 2;
-#endif
+/*
+ * Replace the function starting at start in b, which only prints lit,
+ * by lit itself.  The generated code keeps its number of lines, so that
+ * the line numbers of the code that follows and the source map m of b
+ * stay valid.
+ */
+static void
+fold(struct buffer *b, size_t start, struct buffer *lit, struct lt_srcmap *m)
+{
+	size_t n;
+	long lines;
+
+	srcmap_scan(m, b);
+	for (lines = 0, n = start; n < b->size; n++)
+		if (b->data[n] == '\n')
+			lines++;
+	b->size = start;
+	add_literal(b, lit->data, lit->size);
+	for (lines--, n = 0; n < lit->size; n++)
+		if (lit->data[n] == '\n')
+			lines--;
+	do
+		buf_addchar(b, '\n');
+	while (lines-- > 1);
+	m->scanned = b->size;
+}
+
+/* The state of the reader shared by a template and the ones it inlines */
+struct reader {
+	struct lt_state		*s;
+	struct lt_include_head	*includes;
+	char			**roots;	/* to look up inlined templates */
+	const char		*template;
+	int			 flags;
+	int			 extends;
+	int			 block;
+	struct buffer		 body, blocks, text, *b;
+	struct buffer		 lit[2];	/* the text of main and the block */
+	size_t			 start[2];	/* where their functions start */
+	int			 dynamic[2];	/* whether they contain code */
+	const char		*inlined[LT_MAXINLINE];	/* being read */
+	uint64_t		 hash[LT_MAXINLINE];
+	int			 ninline;
+};
+
+static int inline_include(struct reader *, const char *);
+
+/* Generate the code for the template text from p to pe */
+static int
+scan(struct reader *r, const char *p, const char *pe)
+{
+	int escape, state, output, cb, minify, trim;
+	char fnam[MAXPATHLEN];
+	const char *run, *q, *ttl, *tag;
+	struct lt_state *s = r->s;
 
 	state = s_initial;
 	escape = e_none;
-	extends = 0;
-	block = 0;
 	output = 0;
 	cb = 0;	/* closing braces */
+	minify = (r->flags & LT_MINIFY) != 0;
+	trim = 0;	/* whitespace at the start of the next literal */
+	tag = p;
 
-	while (*p) {
-#ifdef LT_DEBUG
-		if (*p == '\n') {
-			if (s->tline == s->linemax) {
-				s->lines = realloc(s->lines,
-					s->linemax * 2 * sizeof(int));
-				if (s->lines) {
-					memset(&s->lines[s->tline], 0,
-					    s->linemax * sizeof(int));
-					s->linemax *= 2;
-				}
-			}
-			if (s->lines)
-				s->lines[s->tline++] = s->lline++;
-		}
-#endif
+	while (p < pe) {
 		switch (state) {
 		case s_initial:
-			if (strncmp(p, "<%", 2) && (!extends
-			    || (extends && block))) {
-				buf_addstring(b, "print([[");
-				output = 1;
+			if (!MATCH(p, pe, "<%")) {
+				q = find(p, pe, '<', '%');
+				literal(&r->text, p, q, trim,
+				    q < pe && open_trim(q + 2, pe), minify);
+				srcmap_mark(s, r->b == &r->blocks, r->b, p);
+				p = q;
+				trim = 0;
+				if (r->text.size == 0)
+					break;
+				state = s_output;
+				if ((!r->extends || r->block)
+				    && (r->flags & LT_NATIVE)) {
+					native_literal(r->b, s->literals, &r->text);
+					add_run(&r->lit[r->block], r->text.data,
+					    r->text.size);
+					break;
+				}
+				if (!r->extends || r->block) {
+					if (r->text.size >= LT_STATIC_MIN)
+						buf_addstring(r->b,
+						    "print_static([[");
+					else
+						buf_addstring(r->b, "print([[");
+					output = 1;
+				}
+				buf_addlstring(r->b, r->text.data, r->text.size);
+				if (output)
+					add_run(&r->lit[r->block], r->text.data,
+					    r->text.size);
+				break;
 			}
 			state = s_output;
 			/* FALLTHROUGH */
 		case s_output:
-			if (strncmp(p, "<%", 2)) {
-				buf_addchar(b, *p++);
-				break;
-			} else {
-				if (output) {
-					buf_addstring(b, "]])\n");
-					output = 0;
-#ifdef LT_DEBUG
-					s->lline++;
-#endif
+			if (output) {
+				buf_addstring(r->b, "]])\n");
+				output = 0;
+			}
+			p += 2;
+			trim = 0;
+			if (open_trim(p, pe))	/* trim marker */
+				p++;
+			tag = p;
+			srcmap_mark(s, r->b == &r->blocks, r->b, tag);
+			if (p < pe && *p == '=') {	/* expression */
+				int escape_temp, conv, width, prec;
+
+				state = s_expression;
+				p++;
+				escape_temp = escape;
+				if (MATCH(p, pe, "html")) {
+					p += 4;
+					escape_temp = e_html;
+				} else if (MATCH(p, pe, "xml")) {
+					p += 3;
+					escape_temp = e_xml;
+				} else if (MATCH(p, pe, "latex")) {
+					p += 5;
+					escape_temp = e_latex;
+				} else if (MATCH(p, pe, "url")) {
+					p += 3;
+					escape_temp = e_url;
+				} else if (MATCH(p, pe, "none")) {
+					p += 4;
+					escape_temp = e_none;
 				}
-				p += 2;
-				if (*p == '=') {		/* expression */
-					int escape_temp;
-
-					state = s_expression;
-					p++;
-					escape_temp = escape;
-					if (!strncmp(p, "html", 4)) {
-						p += 4;
-						escape_temp = e_html;
-					} else if (!strncmp(p, "xml", 3)) {
-						p += 3;
-						escape_temp = e_xml;
-					} else if (!strncmp(p, "latex", 5)) {
-						p += 5;
-						escape_temp = e_latex;
-					} else if (!strncmp(p, "url", 3)) {
-						p += 3;
-						escape_temp = e_url;
-					} else if (!strncmp(p, "none", 4)) {
-						p += 4;
-						escape_temp = e_none;
-					}
-					switch (escape_temp) {
-					case e_html:
-						buf_addstring(b, "print(escape_html(");
-						cb += 1;
-						break;
-					case e_xml:
-						buf_addstring(b, "print(escape_xml(");
-						cb += 1;
-						break;
-					case e_url:
-						buf_addstring(b, "print(escape_url(");
-						cb += 1;
-						break;
-					case e_latex:
-						buf_addstring(b, "print(escape_latex(");
-						cb += 1;
-						break;
-					default:
-						buf_addstring(b, "print(");
-					}
-					if (*p == '%') {	/* format */
-						buf_addstring(b,
-						    "string.format([[");
-						while (*p && !isspace((int)*p))
-							buf_addchar(b, *p++);
-						buf_addstring(b, "]], ");
-						cb += 1;
-					}
-				} else if (*p == '!') {	/* instr. */
-					state = s_instruction;
-					p++;
-				} else
-					state = s_code;
-				while (isspace((int)*p))
-					p++;
-				if (state == s_expression
-				    || state == s_instruction)
+				conv = 0;
+				run = p;
+				if (p < pe && *p == '%') {	/* format */
+					while (p < pe
+					    && !isspace((unsigned char)*p))
+						p++;
+					conv = lt_native_format(run, p - run,
+					    &width, &prec);
+					/*
+					 * Formatted numbers need no escaping,
+					 * unless padded for an URL.
+					 */
+					if (conv == 's' && escape_temp != e_none)
+						conv = 0;
+					else if (conv && width > 0
+					    && escape_temp == e_url)
+						conv = 0;
+				}
+				if (conv) {
+					if (conv == 'f')
+						snprintf(fnam, sizeof fnam,
+						    "format_f(%d, %d, ",
+						    width, prec);
+					else
+						snprintf(fnam, sizeof fnam,
+						    "format_%c(%d, ",
+						    conv, width);
+					buf_addstring(r->b, fnam);
+				} else switch (escape_temp) {
+				case e_html:
+					buf_addstring(r->b, "print_html(");
 					break;
-			}
+				case e_xml:
+					buf_addstring(r->b, "print_xml(");
+					break;
+				case e_url:
+					buf_addstring(r->b, "print_url(");
+					break;
+				case e_latex:
+					buf_addstring(r->b, "print_latex(");
+					break;
+				default:
+					buf_addstring(r->b, "print(");
+				}
+				if (run < p && !conv) {
+					buf_addstring(r->b, "string.format([[");
+					buf_addlstring(r->b, run, p - run);
+					buf_addstring(r->b, "]], ");
+					cb += 1;
+				}
+			} else if (p < pe && *p == '!') {	/* instr. */
+				state = s_instruction;
+				p++;
+			} else
+				state = s_code;
+			if (state != s_instruction)
+				r->dynamic[r->block] = 1;
+			p = skip_space(p, pe);
+			if (state == s_expression
+			    || state == s_instruction)
+				break;
 			/* FALLTHROUGH */
 		case s_code:
-			if (strncmp(p, "%>", 2))
-				buf_addchar(b, *p++);
+			if (!MATCH(p, pe, "%>"))
+				p = copy_run(r->b, p, pe, '%', '>');
 			else {
-				buf_addstring(b, "\n");
+				trim = trim_mark(r->b, tag, p);
+				buf_addstring(r->b, "\n");
 				state = s_initial;
 				p += 2;
-#ifdef LT_DEBUG
-				s->lline++;
-#endif
 			}
 			break;
 		case s_expression:
-			if (strncmp(p, "%>", 2))
-				buf_addchar(b, *p++);
+			if (!MATCH(p, pe, "%>"))
+				p = copy_run(r->b, p, pe, '%', '>');
 			else {
+				trim = trim_mark(r->b, tag, p);
 				state = s_initial;
 				for (; cb > 0; cb--)
-					buf_addchar(b, ')');
-				buf_addstring(b, ")\n");
+					buf_addchar(r->b, ')');
+				buf_addstring(r->b, ")\n");
 				p += 2;
-#ifdef LT_DEBUG
-				s->lline++;
-#endif
 			}
 			break;
 		case s_instruction:
-			if (!strncmp(p, "include", 7)) {
-				bzero(fnam, sizeof fnam);
-				n = 0;
-				p += 7;
-				while (isspace((int)*p))
-					p++;
-				if (*p == '"' || *p == '\'') {
-					p++;
-					while (*p && *p != '"' && *p != '\''
-					    && n < sizeof fnam)
-						fnam[n++] = *p++;
-				} else {
-					while (*p && !isspace((int)*p)
-					    && !(*p == '%' && *(p + 1) == '>')
-					    && n < sizeof fnam)
-						fnam[n++] = *p++;
-				}
-				buf_addstring(b, "render_template(_ENV, '");
-				buf_addstring(b, fnam);
-				buf_addstring(b, "')\n");
-				exists = 0;
-				SLIST_FOREACH(include, includes, next)
-					if (!strcmp(include->fnam, fnam)) {
-						exists = 1;
-						break;
-					}
-				if (!exists) {
-					include = malloc(
-					    sizeof(struct lt_include));
-					include->fnam = strdup(fnam);
-					SLIST_INSERT_HEAD(includes, include,
-					    next);
+			if (MATCH(p, pe, "include")) {
+				p = get_name(p + 7, pe, fnam, sizeof fnam);
+				lt_add_include(r->includes, fnam);
+				if (!(r->flags & LT_INLINE)
+				    || inline_include(r, fnam)) {
+					buf_addstring(r->b,
+					    "render_template(_ENV, '");
+					buf_addstring(r->b, fnam);
+					buf_addstring(r->b, "')\n");
+					r->dynamic[r->block] = 1;
 				}
-#ifdef LT_DEBUG
-				s->lline++;
-#endif
-			} else if (!strncmp(p, "escape", 6)) {
-				p += 6;
-				while (isspace((int)*p))
-					p++;
-				if (!strncmp(p, "none", 4)) {
+			} else if (MATCH(p, pe, "cache")) {
+				/* The last word is the TTL, the rest the key */
+				p = skip_space(p + 5, pe);
+				q = find(p, pe, '%', '>');
+				if (q > p && q[-1] == '-')
+					q--;
+				while (q > p && isspace((unsigned char)q[-1]))
+					q--;
+				for (ttl = q; ttl > p
+				    && !isspace((unsigned char)ttl[-1]); ttl--)
+					;
+				buf_addstring(r->b, "if cache_begin(");
+				if (ttl > p)
+					buf_addlstring(r->b, p, ttl - p);
+				else
+					buf_addstring(r->b, "''");
+				buf_addstring(r->b, ", ");
+				if (q > ttl)
+					buf_addlstring(r->b, ttl, q - ttl);
+				else
+					buf_addchar(r->b, '0');
+				snprintf(fnam, sizeof fnam, ", %d) then\n",
+				    escape);
+				buf_addstring(r->b, fnam);
+				r->dynamic[r->block] = 1;
+				p = q;
+			} else if (MATCH(p, pe, "endcache")) {
+				p += 8;
+				buf_addstring(r->b, "cache_end()\nend\n");
+			} else if (MATCH(p, pe, "escape")) {
+				p = skip_space(p + 6, pe);
+				if (MATCH(p, pe, "none")) {
 					escape = e_none;
 					p += 4;
-				} else if (!strncmp(p, "html", 4)) {
+				} else if (MATCH(p, pe, "html")) {
 					escape = e_html;
 					p += 4;
-				} else if (!strncmp(p, "latex", 5)) {
+				} else if (MATCH(p, pe, "latex")) {
 					escape = e_latex;
 					p += 5;
-				} else if (!strncmp(p, "url", 3)) {
+				} else if (MATCH(p, pe, "url")) {
 					escape = e_url;
 					p += 3;
 				}
-			} else if (!strncmp(p, "block", 5)) {
-				bzero(fnam, sizeof fnam);
-				n = 0;
-				p += 5;
-				while (isspace((int)*p))
-					p++;
-				if (*p == '"' || *p == '\'') {
-					p++;
-					while (*p && *p != '"' && *p != '\''
-					    && n < sizeof fnam)
-						fnam[n++] = *p++;
-				} else {
-					while (*p && !isspace((int)*p)
-					    && !(*p == '%' && *(p + 1) == '>')
-					    && n < sizeof fnam)
-						fnam[n++] = *p++;
+			} else if (MATCH(p, pe, "minify")) {
+				p = skip_space(p + 6, pe);
+				if (MATCH(p, pe, "none")) {
+					minify = 0;
+					p += 4;
+				} else if (MATCH(p, pe, "html")) {
+					minify = 1;
+					p += 4;
 				}
-				b = &blocks;
-				if (!extends) {
-					buf_addstring(b, "if template['");
-					buf_addstring(b, template);
-					buf_addstring(b, "'].blk['");
-					buf_addstring(b, fnam);
-					buf_addstring(b, "'] == nil then\n");
-#ifdef LT_DEBUG
-					s->lline++;
-#endif
+			} else if (MATCH(p, pe, "block")) {
+				p = get_name(p + 5, pe, fnam, sizeof fnam);
+				r->b = &r->blocks;
+				if (!r->extends) {
+					buf_addstring(r->b, "if template['");
+					buf_addstring(r->b, r->template);
+					buf_addstring(r->b, "'].blk['");
+					buf_addstring(r->b, fnam);
+					buf_addstring(r->b, "'] == nil then\n");
 				}
-				buf_addstring(b, "template['");
-				buf_addstring(b, template);
-				buf_addstring(b, "'].blk['");
-				buf_addstring(b, fnam);
-				buf_addstring(b, "'] = function (_ENV)\n");
-				block = 1;
-#ifdef LT_DEBUG
-				s->lline++;
-#endif
-			} else if (!strncmp(p, "endblock", 8)) {
+				buf_addstring(r->b, "template['");
+				buf_addstring(r->b, r->template);
+				buf_addstring(r->b, "'].blk['");
+				buf_addstring(r->b, fnam);
+				buf_addstring(r->b, "'] = ");
+				r->start[1] = r->b->size;
+				srcmap_mark(s, 1, r->b, p);
+				buf_addstring(r->b, "function (_ENV)\n");
+				r->lit[1].size = 0;
+				r->dynamic[1] = 0;
+				r->block = 1;
+			} else if (MATCH(p, pe, "endblock")) {
 				p += 8;
-				if (!extends) {
-					buf_addstring(b, "end\n");
-#ifdef LT_DEBUG
-					s->lline++;
-				}
-				s->lline++;
-#else
-				}
-#endif
-				buf_addstring(b, "end\n");
-				b = &body;
-				if (!extends) {
-					buf_addstring(b,
+				buf_addstring(r->b, "end\n");
+				if (r->block && !r->dynamic[1])
+					fold(r->b, r->start[1], &r->lit[1],
+					    &s->map[1]);
+				if (!r->extends)
+					buf_addstring(r->b, "end\n");
+				r->b = &r->body;
+				if (!r->extends) {
+					srcmap_mark(s, 0, r->b, p);
+					buf_addstring(r->b,
 					    "render_block(_ENV, _t, '");
-					buf_addstring(b, fnam);
-					buf_addstring(b, "')\n");
-#ifdef LT_DEBUG
-					s->lline++;
-#endif
-				}
-				block = 0;
-			} else if (!strncmp(p, "extends", 7)) {
-				if (!extends) {
-					buf_addstring(b, "end\n");
-#ifdef LT_DEBUG
-					s->lline++;
-#endif
-				}
-				bzero(fnam, sizeof fnam);
-				n = 0;
-				p += 7;
-				while (isspace((int)*p))
-					p++;
-				if (*p == '"' || *p == '\'') {
-					p++;
-					while (*p && *p != '"' && *p != '\''
-					    && n < sizeof fnam)
-						fnam[n++] = *p++;
-				} else {
-					while (*p && !isspace((int)*p)
-					    && !(*p == '%' && *(p + 1) == '>')
-					    && n < sizeof fnam)
-						fnam[n++] = *p++;
+					buf_addstring(r->b, fnam);
+					buf_addstring(r->b, "')\n");
+					r->dynamic[0] = 1;
 				}
-				buf_addstring(b, "template['");
-				buf_addstring(b, template);
-				buf_addstring(b, "'].main = nil\n");
-
-				buf_addstring(b, "template['");
-				buf_addstring(b, template);
-				buf_addstring(b, "'].extends = '");
-				buf_addstring(b, fnam);
-				buf_addstring(b, "'\n");
-				extends = 1;
-				exists = 0;
-				SLIST_FOREACH(include, includes, next)
-					if (!strcmp(include->fnam, fnam)) {
-						exists = 1;
-						break;
-					}
-				if (!exists) {
-					include = malloc(
-					    sizeof(struct lt_include));
-					include->fnam = strdup(fnam);
-					SLIST_INSERT_HEAD(includes, include,
-					    next);
-				}
-#ifdef LT_DEBUG
-				s->lline++;
-#endif
+				r->block = 0;
+			} else if (MATCH(p, pe, "extends")) {
+				if (!r->extends)
+					buf_addstring(r->b, "end\n");
+				p = get_name(p + 7, pe, fnam, sizeof fnam);
+				buf_addstring(r->b, "template['");
+				buf_addstring(r->b, r->template);
+				buf_addstring(r->b, "'].main = nil\n");
+
+				buf_addstring(r->b, "template['");
+				buf_addstring(r->b, r->template);
+				buf_addstring(r->b, "'].extends = '");
+				buf_addstring(r->b, fnam);
+				buf_addstring(r->b, "'\n");
+				r->extends = 1;
+				lt_add_include(r->includes, fnam);
 			}
-			while (*p && strncmp(p, "%>", 2))
-				p++;
-			if (*p)
+			p = find(p, pe, '%', '>');
+			if (p < pe) {
+				trim = trim_mark(NULL, tag, p);
 				p += 2;
+			}
 			state = s_initial;
 			break;
 		}
 	}
-	if (*p == '\0') {
-		if (state == s_output && !extends) {
-			buf_addstring(b, "]])\n");
-#ifdef LT_DEBUG
-			s->lline++;
-#endif
-		}
-		if (state == s_output || state == s_initial)
-			state = s_terminate;
-		else
-			state = s_error;
-		if (!extends) {
-			buf_addstring(b, "end\n");
-#ifdef LT_DEBUG
-			s->lline++;
-#endif
+	if (output && !r->extends)
+		buf_addstring(r->b, "]])\n");
+	return state == s_output || state == s_initial ? s_terminate : s_error;
+}
+
+/*
+ * Check whether the template text from p to pe can be inlined, which is
+ * not the case if it extends another template or defines blocks.
+ */
+static int
+inlinable(const char *p, const char *pe)
+{
+	while ((p = find(p, pe, '<', '%')) < pe) {
+		p += 2;
+		if (open_trim(p, pe))
+			p++;
+		if (p < pe && *p == '!') {
+			p = skip_space(p + 1, pe);
+			if (MATCH(p, pe, "block") || MATCH(p, pe, "extends"))
+				return 0;
 		}
 	}
-	buf_push(&blocks, L);
-	buf_push(&body, L);
+	return 1;
+}
+
+/*
+ * Put the code of the included template fnam in place of a call to
+ * render_template().  It gets its own scope and, like when rendered on
+ * its own, starts without escaping.  Returns -1 if fnam can't be inlined,
+ * with nothing added, so that it is rendered at runtime.
+ */
+static int
+inline_include(struct reader *r, const char *fnam)
+{
+	struct lt_state *s = r->s;
+	struct lt_srcmap *m = &s->map[r->b == &r->blocks];
+	struct lt_include *include;
+	struct stat sb;
+	char path[PATH_MAX];
+	const char *scanned;
+	char *text;
+	size_t size, lit, runs, mscanned, names;
+	uint32_t tline, file, line, nnames;
+	uint64_t hash;
+	int dynamic, fd, n, rv;
 
-	buf_free(&blocks);
-	buf_free(&body);
+	/* Outside of blocks, templates extending another print nothing */
+	if (r->ninline == LT_MAXINLINE || (r->extends && !r->block))
+		return -1;
+	if (!strcmp(fnam, r->template))
+		return -1;
+	hash = lt_hash(fnam, strlen(fnam));
+	for (n = 0; n < r->ninline; n++)
+		if (r->hash[n] == hash && !strcmp(r->inlined[n], fnam))
+			return -1;
+	if (lt_resolve(r->roots, fnam, path, sizeof path, &sb))
+		return -1;
+	if ((include = lt_find_include(r->includes, fnam)) == NULL)
+		return -1;
+	if (sb.st_size == 0)
+		goto inlined;
 
-	if (print) {
-		printf("%s", lua_tostring(L, -1));
-		printf("%s", lua_tostring(L, -2));
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return -1;
+	if ((text = mmap(0, sb.st_size, PROT_READ, MAP_PRIVATE | MAP_FILE,
+	    fd, (off_t)0L)) == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	rv = -1;
+	if (!inlinable(text, text + sb.st_size))
+		goto out;
+
+	size = r->b->size;
+	lit = r->lit[r->block].size;
+	dynamic = r->dynamic[r->block];
+	runs = m->runs.size;
+	mscanned = m->scanned;
+	line = m->line;
+	names = s->names.size;
+	nnames = s->nnames;
+	scanned = s->scanned;
+	tline = s->tline;
+	file = s->file;
+
+	r->inlined[r->ninline] = fnam;
+	r->hash[r->ninline++] = hash;
+	buf_addstring(r->b, "do\n");
+	s->file = srcmap_file(s, fnam);
+	s->scanned = text;
+	s->tline = 1;
+	rv = scan(r, text, text + sb.st_size) == s_terminate ? 0 : -1;
+	buf_addstring(r->b, "end\n");
+	r->ninline--;
+	s->scanned = scanned;
+	s->tline = tline;
+	s->file = file;
+
+	if (rv) {
+		r->b->size = size;
+		r->lit[r->block].size = lit;
+		r->dynamic[r->block] = dynamic;
+		m->runs.size = runs;
+		m->scanned = mscanned;
+		m->line = line;
+		s->names.size = names;
+		s->nnames = nnames;
+	}
+out:
+	munmap(text, sb.st_size);
+	close(fd);
+	if (rv)
+		return -1;
+inlined:
+	/* The compiled template is only current as long as fnam is */
+	include->mtime = sb.st_mtime;
+	include->size = sb.st_size;
+	return 0;
+}
+
+/*
+ * Generate the code of template, whose text of len bytes is at p, and
+ * push it as a single chunk.  It creates the template entry, followed by
+ * the blocks the template defines, and ends with the source map.
+ */
+int
+reader(lua_State *L, const char *p, size_t len, struct lt_state *s,
+    struct lt_include_head *includes, char **roots, const char *template,
+    int flags)
+{
+	struct reader r;
+
+	r.s = s;
+	r.includes = includes;
+	r.roots = roots;
+	r.template = template;
+	r.flags = flags;
+	r.extends = 0;
+	r.block = 0;
+	r.ninline = 0;
+	buf_init(&r.body);
+	buf_init(&r.blocks);
+	buf_init(&r.lit[0]);
+	buf_init(&r.lit[1]);
+	buf_init(&r.text);
+	srcmap_init(s, p);
+	if (r.body.error || r.blocks.error || r.lit[0].error || r.lit[1].error
+	    || r.text.error || s->map[0].runs.error || s->map[1].runs.error
+	    || s->names.error)
+		goto fail;
+	r.b = &r.body;
+
+	buf_addstring(r.b, flags & LT_NATIVE ? LT_NATIVE_ENV LT_LOCALS
+	    : LT_PROLOGUE);
+	buf_addstring(r.b, "template['");
+	buf_addstring(r.b, template);
+	buf_addstring(r.b, "'] = { blk = {} }\ntemplate['");
+	buf_addstring(r.b, template);
+	buf_addstring(r.b, "'].main = ");
+	r.start[0] = r.b->size;
+	buf_addstring(r.b, "function(_ENV, _t)\n");
+	r.dynamic[0] = r.dynamic[1] = 0;
+
+	/* The blocks start as if they followed the prologue */
+	buf_addstring(&r.blocks, LT_PROLOGUE);
+
+	scan(&r, p, p + len);
+	if (!r.extends) {
+		buf_addstring(r.b, "end\n");
+		if (r.b == &r.body && !r.dynamic[0])
+			fold(r.b, r.start[0], &r.lit[0], &s->map[0]);
 	}
+	srcmap_join(s, &r.body, &r.blocks, sizeof LT_PROLOGUE - 1);
+	srcmap_emit(s, &r.body, template);
+	if (r.body.error || r.blocks.error || r.lit[0].error || r.lit[1].error
+	    || r.text.error || s->map[0].runs.error || s->map[1].runs.error
+	    || s->names.error)
+		goto fail;
+	buf_push(&r.body, L);
+
+	buf_free(&r.text);
+	buf_free(&r.lit[0]);
+	buf_free(&r.lit[1]);
+	buf_free(&r.blocks);
+	buf_free(&r.body);
+
+	if (flags & LT_PRINT)
+		printf("%s", lua_tostring(L, -1));
+	return 0;
+
+fail:
+	buf_free(&r.text);
+	buf_free(&r.lit[0]);
+	buf_free(&r.lit[1]);
+	buf_free(&r.blocks);
+	buf_free(&r.body);
+	srcmap_free(s);
+	lua_pushstring(L, "memory error");
+	return -1;
 }
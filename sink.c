@@ -0,0 +1,438 @@
+/*
+ * Copyright (C) 2021 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Output sinks.  Everything a template prints is collected in the output
+ * buffer of the render state of its coroutine.  When rendering to a
+ * string the buffer just grows, for streaming sinks it is flushed to a
+ * file descriptor or the sink function whenever it holds more than
+ * bufsize bytes, and at the end of the render.
+ *
+ * A streaming sink can compress, then the output is deflated when it is
+ * flushed and the sink gets a gzip stream.  Large static literals are
+ * compressed once and spliced into the stream as they are, see
+ * sink_static().
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <zlib.h>
+
+#include "buffer.h"
+#include "luatemplate.h"
+
+#define GZIP_TRAILER	8
+#define WINDOW_SIZE	32768
+
+static const char gzip_header[] = "\x1f\x8b\x08\0\0\0\0\0\0\x03";
+
+struct lt_deflate {
+	z_stream	zs;	/* raw deflate, gzip framing is ours */
+	int		level;
+	uLong		crc;
+	uLong		total;	/* uncompressed bytes */
+	size_t		fed;	/* deflated since the last reset */
+	struct buffer	out;	/* compressed, not yet delivered */
+};
+
+/* The compressed form of a static literal */
+struct lt_blob {
+	uLong	crc;
+	size_t	clen;
+	char	data[];
+};
+
+/* Write both buffers of iov to fd */
+static void
+write_iov(lua_State *L, int fd, struct iovec *iov)
+{
+	ssize_t n;
+	int i;
+
+	for (i = 0; i < 2 && iov[i].iov_len == 0; i++)
+		;
+	while (i < 2) {
+		if ((n = writev(fd, iov + i, 2 - i)) == -1) {
+			if (errno == EINTR)
+				continue;
+			luaL_error(L, "write error: %s", strerror(errno));
+		}
+		for (; i < 2 && (size_t)n >= iov[i].iov_len; i++)
+			n -= iov[i].iov_len;
+		if (i < 2) {
+			iov[i].iov_base = (char *)iov[i].iov_base + n;
+			iov[i].iov_len -= n;
+		}
+	}
+}
+
+/*
+ * Write the pending output followed by s to the file descriptor, without
+ * copying s into the buffer first.
+ */
+static void
+write_fd(lua_State *L, struct lt_render *r, const char *s, size_t len)
+{
+	struct iovec iov[2];
+
+	iov[0].iov_base = r->out.data + r->sink.base;
+	iov[0].iov_len = r->out.size - r->sink.base;
+	iov[1].iov_base = (void *)s;
+	iov[1].iov_len = len;
+	r->out.size = r->sink.base;
+	r->sinkcalls++;
+	write_iov(L, r->sink.fd, iov);
+}
+
+/* The continuation of a C function whose call of the sink yielded */
+static int
+sink_done(lua_State *L, int status, lua_KContext nresults)
+{
+	return (int)nresults;
+}
+
+/*
+ * Pass the len bytes at s on to the sink and drop them by setting *size
+ * to keep.  With nresults >= 0 the sink function may yield: the C
+ * function running must return the result of deliver(), its nresults
+ * values on top of the stack are then returned by the continuation.
+ */
+static int
+deliver(lua_State *L, struct lt_render *r, const char *s, size_t len,
+    size_t *size, size_t keep, int nresults)
+{
+	struct iovec iov[2];
+
+	if (len == 0)
+		return nresults;
+	r->sinkcalls++;
+	if (r->sink.type == LT_SINK_FD) {
+		iov[0].iov_base = (void *)s;
+		iov[0].iov_len = len;
+		iov[1].iov_len = 0;
+		*size = keep;
+		write_iov(L, r->sink.fd, iov);
+		return nresults;
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, r->sinkref);
+	lua_pushlstring(L, s, len);
+	*size = keep;
+	if (nresults < 0)
+		lua_call(L, 1, 0);
+	else
+		lua_callk(L, 1, 0, nresults, sink_done);
+	return nresults;
+}
+
+/* Pass the compressed output on to the sink */
+static int
+deliver_compressed(lua_State *L, struct lt_render *r, int nresults)
+{
+	struct lt_deflate *z = r->sink.z;
+
+	return deliver(L, r, z->out.data, z->out.size, &z->out.size, 0,
+	    nresults);
+}
+
+/* Run the deflate stream zs over its input, appending to out */
+static int
+run_deflate(z_stream *zs, struct buffer *out, int flush)
+{
+	int rv;
+
+	do {
+		if (buf_reserve(out, BUFFER_SIZE))
+			return -1;
+		zs->next_out = (Bytef *)out->data + out->size;
+		zs->avail_out = out->capacity - out->size;
+		rv = deflate(zs, flush);
+		out->size = out->capacity - zs->avail_out;
+		if (rv == Z_STREAM_ERROR)
+			return -1;
+	} while (zs->avail_out == 0
+	    || (flush == Z_FINISH && rv != Z_STREAM_END));
+	return 0;
+}
+
+/*
+ * Deflate the pending output of the render.  A Z_SYNC_FLUSH ends the
+ * compressed data on a byte boundary, so that other deflate blocks can
+ * follow.
+ */
+static void
+compress_pending(lua_State *L, struct lt_render *r, int flush)
+{
+	struct lt_deflate *z = r->sink.z;
+	size_t len;
+
+	len = r->out.size - r->sink.base;
+	if (len == 0 && (flush == Z_NO_FLUSH
+	    || (flush == Z_SYNC_FLUSH && z->fed == 0)))
+		return;
+	z->zs.next_in = (Bytef *)r->out.data + r->sink.base;
+	z->zs.avail_in = len;
+	z->crc = crc32(z->crc, z->zs.next_in, len);
+	z->total += len;
+	z->fed += len;
+	r->out.size = r->sink.base;
+	if (run_deflate(&z->zs, &z->out, flush)) {
+		z->out.error = 0;
+		luaL_error(L, "compression failed");
+	}
+}
+
+/*
+ * Set up compression at level for the current sink.  The gzip header goes
+ * out with the first compressed chunk.
+ */
+int
+sink_compress(struct lt_render *r, int level)
+{
+	struct lt_deflate *z;
+
+	if ((z = calloc(1, sizeof(struct lt_deflate))) == NULL)
+		return -1;
+	if (buf_init(&z->out) || deflateInit2(&z->zs, level, Z_DEFLATED,
+	    -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		buf_free(&z->out);
+		free(z);
+		return -1;
+	}
+	z->level = level;
+	z->crc = crc32(0L, Z_NULL, 0);
+	buf_addlstring(&z->out, gzip_header, sizeof gzip_header - 1);
+	r->sink.z = z;
+	return 0;
+}
+
+/* Release the compression state of the current sink, if any */
+void
+sink_compress_end(struct lt_render *r)
+{
+	struct lt_deflate *z = r->sink.z;
+
+	if (z == NULL)
+		return;
+	deflateEnd(&z->zs);
+	buf_free(&z->out);
+	free(z);
+	r->sink.z = NULL;
+}
+
+/* Compress the static literal s on its own and push it as lt_blob */
+static struct lt_blob *
+precompress(lua_State *L, struct lt_render *r, const char *s, size_t len)
+{
+	struct lt_blob *blob;
+	struct buffer out;
+	z_stream zs;
+
+	memset(&zs, 0, sizeof zs);
+	if (buf_init(&out) || deflateInit2(&zs, r->sink.z->level,
+	    Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		buf_free(&out);
+		luaL_error(L, "memory error");
+	}
+	zs.next_in = (Bytef *)s;
+	zs.avail_in = len;
+	if (run_deflate(&zs, &out, Z_SYNC_FLUSH)) {
+		deflateEnd(&zs);
+		buf_free(&out);
+		luaL_error(L, "compression failed");
+	}
+	deflateEnd(&zs);
+
+	blob = lua_newuserdata(L, sizeof(struct lt_blob) + out.size);
+	blob->crc = crc32(crc32(0L, Z_NULL, 0), (const Bytef *)s, len);
+	blob->clen = out.size;
+	memcpy(blob->data, out.data, out.size);
+	buf_free(&out);
+	return blob;
+}
+
+/* Output of a cache region is kept until the region ends */
+#define CAPTURING(r)	((r)->ncapture > 0 \
+	&& (r)->capture[(r)->ncapture - 1].depth == (r)->depth)
+
+void
+sink_write(lua_State *L, struct lt_render *r, const char *s, size_t len)
+{
+	r->written += len;
+	if (r->sink.type == LT_SINK_FD && r->sink.z == NULL
+	    && !CAPTURING(r)
+	    && r->out.size - r->sink.base + len >= r->ctx->bufsize) {
+		write_fd(L, r, s, len);
+		return;
+	}
+	if (buf_addlstring(&r->out, s, len)) {
+		/* The buffer is still intact, later renders may succeed */
+		r->out.error = 0;
+		luaL_error(L, "memory error");
+	}
+	/* Sink functions are called by sink_poll(), so that they can yield */
+	if (r->sink.type == LT_SINK_FD
+	    && r->out.size - r->sink.base >= r->ctx->bufsize)
+		sink_flush(L, r);
+}
+
+/*
+ * Call the sink function once bufsize bytes are pending.  C functions
+ * called by templates push their nresults results, then return
+ * sink_poll(), so that the sink function can yield.
+ */
+int
+sink_poll(lua_State *L, struct lt_render *r, int nresults)
+{
+	struct lt_deflate *z = r->sink.z;
+
+	if (r->sink.type != LT_SINK_FUNCTION || CAPTURING(r))
+		return nresults;
+	if (z != NULL) {
+		if (r->out.size - r->sink.base >= r->ctx->bufsize)
+			compress_pending(L, r, Z_NO_FLUSH);
+		if (z->out.size < r->ctx->bufsize)
+			return nresults;
+		return deliver_compressed(L, r, nresults);
+	}
+	if (r->out.size - r->sink.base < r->ctx->bufsize)
+		return nresults;
+	return deliver(L, r, r->out.data + r->sink.base,
+	    r->out.size - r->sink.base, &r->out.size, r->sink.base,
+	    nresults);
+}
+
+/*
+ * Write the static literal at index idx.  When compressing, literals of
+ * at least LT_STATIC_MIN bytes are compressed once, kept in the compressed
+ * table of the container, and spliced into the stream: the stream is
+ * flushed to a byte boundary, the blob appended, and deflate restarted
+ * with the literal as dictionary.
+ */
+void
+sink_static(lua_State *L, struct lt_render *r, int container, int idx)
+{
+	struct lt_deflate *z = r->sink.z;
+	struct lt_blob *blob;
+	const char *s;
+	size_t len, dict;
+
+	s = lua_tolstring(L, idx, &len);
+	if (z == NULL || len < LT_STATIC_MIN || CAPTURING(r)) {
+		sink_write(L, r, s, len);
+		return;
+	}
+	idx = lua_absindex(L, idx);
+	lua_getfield(L, container, "compressed");
+	lua_pushvalue(L, idx);
+	if (lua_rawget(L, -2) == LUA_TUSERDATA)
+		blob = lua_touserdata(L, -1);
+	else {
+		lua_pop(L, 1);
+		blob = precompress(L, r, s, len);
+		lua_pushvalue(L, idx);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, -4);
+	}
+
+	r->written += len;
+	compress_pending(L, r, Z_SYNC_FLUSH);
+	if (buf_addlstring(&z->out, blob->data, blob->clen)) {
+		z->out.error = 0;
+		luaL_error(L, "memory error");
+	}
+	z->crc = crc32_combine(z->crc, blob->crc, len);
+	z->total += len;
+	z->fed = 0;
+	dict = len < WINDOW_SIZE ? len : WINDOW_SIZE;
+	deflateReset(&z->zs);
+	deflateSetDictionary(&z->zs, (const Bytef *)s + len - dict, dict);
+	lua_pop(L, 2);
+	if (r->sink.type == LT_SINK_FD && z->out.size >= r->ctx->bufsize)
+		deliver_compressed(L, r, -1);
+}
+
+/* Hand the pending output of the current render to its sink */
+void
+sink_flush(lua_State *L, struct lt_render *r)
+{
+	size_t len;
+
+	len = r->out.size - r->sink.base;
+	if (len == 0 || r->sink.type == LT_SINK_BUFFER || CAPTURING(r))
+		return;
+
+	if (r->sink.z != NULL) {
+		compress_pending(L, r, Z_NO_FLUSH);
+		if (r->sink.z->out.size >= r->ctx->bufsize)
+			deliver_compressed(L, r, -1);
+	} else if (r->sink.type == LT_SINK_FD)
+		write_fd(L, r, NULL, 0);
+	else
+		deliver(L, r, r->out.data + r->sink.base, len,
+		    &r->out.size, r->sink.base, -1);
+}
+
+/*
+ * Flush the output at the end of a render, ending a gzip stream.  The
+ * sink function may yield, see sink_poll() for nresults.
+ */
+int
+sink_finish(lua_State *L, struct lt_render *r, int nresults)
+{
+	struct lt_deflate *z = r->sink.z;
+	unsigned char trailer[GZIP_TRAILER];
+	int n;
+
+	if (r->sink.type == LT_SINK_BUFFER || CAPTURING(r))
+		return nresults;
+	if (z == NULL) {
+		if (r->sink.type == LT_SINK_FD) {
+			sink_flush(L, r);
+			return nresults;
+		}
+		return deliver(L, r, r->out.data + r->sink.base,
+		    r->out.size - r->sink.base, &r->out.size,
+		    r->sink.base, nresults);
+	}
+	compress_pending(L, r, Z_FINISH);
+	for (n = 0; n < 4; n++) {
+		trailer[n] = (z->crc >> (8 * n)) & 0xff;
+		trailer[n + 4] = (z->total >> (8 * n)) & 0xff;
+	}
+	if (buf_addlstring(&z->out, (char *)trailer, sizeof trailer)) {
+		z->out.error = 0;
+		luaL_error(L, "memory error");
+	}
+	return deliver_compressed(L, r, nresults);
+}
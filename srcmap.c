@@ -0,0 +1,331 @@
+/*
+ * Copyright (C) 2021 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Source maps.  While the reader generates the code of a template, it
+ * marks where the code of each template construct starts.  The marks are
+ * kept as runs of struct lt_line, sorted by generated line, and stored as
+ * a string constant at the end of the chunk, from where it ends up in the
+ * template entry.  A run only starts where the lines of the generated
+ * code and the template stop advancing together, which is rare, as code
+ * and expressions are copied verbatim.  Code of inlined includes refers
+ * to the inlined field of the entry, which lists their names.  The map
+ * is only searched when an error occurs.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "buffer.h"
+#include "luatemplate.h"
+
+/* Start the maps of a template starting at p, check runs.error */
+void
+srcmap_init(struct lt_state *s, const char *p)
+{
+	int chunk;
+
+	s->scanned = p;
+	s->tline = 1;
+	s->file = 0;
+	buf_init(&s->names);
+	s->nnames = 0;
+	for (chunk = 0; chunk < 2; chunk++) {
+		buf_init(&s->map[chunk].runs);
+		s->map[chunk].scanned = 0;
+		s->map[chunk].line = 1;
+	}
+}
+
+void
+srcmap_free(struct lt_state *s)
+{
+	buf_free(&s->names);
+	buf_free(&s->map[0].runs);
+	buf_free(&s->map[1].runs);
+}
+
+/* Count the lines of code added since the last call */
+void
+srcmap_scan(struct lt_srcmap *m, struct buffer *code)
+{
+	const char *p, *pe;
+
+	pe = code->data + code->size;
+	for (p = code->data + m->scanned;
+	    (p = memchr(p, '\n', pe - p)) != NULL; p++)
+		m->line++;
+	m->scanned = code->size;
+}
+
+/*
+ * Mark that the code added next to code, the chunk of the map, comes from
+ * the template text at p.  A later mark on the same line replaces an
+ * earlier one, so that the construct that actually produced code wins.
+ */
+void
+srcmap_mark(struct lt_state *s, int chunk, struct buffer *code,
+    const char *p)
+{
+	struct lt_srcmap *m = &s->map[chunk];
+	struct lt_line *r, run;
+	const char *q;
+	size_t n;
+
+	if (p > s->scanned) {
+		for (q = s->scanned; (q = memchr(q, '\n', p - q)) != NULL;
+		    q++)
+			s->tline++;
+		s->scanned = p;
+	}
+	srcmap_scan(m, code);
+
+	run.line = m->line;
+	run.tline = s->tline;
+	run.file = s->file;
+	r = (struct lt_line *)m->runs.data;
+	n = m->runs.size / sizeof run;
+	if (n > 0 && r[n - 1].line == run.line)
+		n--;
+	m->runs.size = n * sizeof run;
+	if (n > 0 && r[n - 1].file == run.file
+	    && (long)run.line - r[n - 1].line
+	    == (long)run.tline - r[n - 1].tline)
+		return;
+	buf_addlstring(&m->runs, (const char *)&run, sizeof run);
+}
+
+/* The number of the inlined template fnam, for s->file */
+uint32_t
+srcmap_file(struct lt_state *s, const char *fnam)
+{
+	const char *p, *pe;
+	uint32_t n;
+
+	p = s->names.data;
+	pe = p + s->names.size;
+	for (n = 1; p < pe; p += strlen(p) + 1, n++)
+		if (!strcmp(p, fnam))
+			return n;
+	buf_addlstring(&s->names, fnam, strlen(fnam) + 1);
+	return ++s->nnames;
+}
+
+static const char *
+name(struct lt_state *s, uint32_t file)
+{
+	const char *p;
+
+	for (p = s->names.data; --file > 0; p += strlen(p) + 1)
+		;
+	return p;
+}
+
+/*
+ * Append the code of more after the first skip bytes to code, which ends
+ * with a complete line, and the map of more to the map of code.
+ */
+void
+srcmap_join(struct lt_state *s, struct buffer *code, struct buffer *more,
+    size_t skip)
+{
+	struct lt_srcmap *m = &s->map[0];
+	struct lt_line *r;
+	const char *p;
+	size_t n;
+	long offset;
+
+	/* Line skip + 1 of more becomes the current line of code */
+	srcmap_scan(m, code);
+	offset = (long)m->line - 1;
+	for (p = more->data; (p = memchr(p, '\n', more->data + skip - p))
+	    != NULL; p++)
+		offset--;
+
+	r = (struct lt_line *)s->map[1].runs.data;
+	for (n = 0; n < s->map[1].runs.size / sizeof *r; n++) {
+		r[n].line += offset;
+		buf_addlstring(&m->runs, (const char *)&r[n], sizeof *r);
+	}
+	buf_addlstring(code, more->data + skip, more->size - skip);
+}
+
+/* Add the map to code, as fields of the entry of template */
+void
+srcmap_emit(struct lt_state *s, struct buffer *code, const char *template)
+{
+	struct buffer *runs = &s->map[0].runs;
+	char esc[8];
+	uint32_t file;
+	size_t n;
+	unsigned char c;
+
+	if (runs->size == 0)
+		return;
+	buf_addstring(code, "template['");
+	buf_addstring(code, template);
+	buf_addstring(code, "'].map = \"");
+	for (n = 0; n < runs->size; n++) {
+		c = runs->data[n];
+		if (c >= ' ' && c < 0x7f && c != '"' && c != '\\')
+			buf_addchar(code, c);
+		else {
+			snprintf(esc, sizeof esc, "\\%03u", c);
+			buf_addstring(code, esc);
+		}
+	}
+	buf_addstring(code, "\"\n");
+
+	if (s->nnames == 0)
+		return;
+	buf_addstring(code, "template['");
+	buf_addstring(code, template);
+	buf_addstring(code, "'].inlined = {");
+	for (file = 1; file <= s->nnames; file++) {
+		buf_addstring(code, file > 1 ? ", '" : " '");
+		buf_addstring(code, name(s, file));
+		buf_addchar(code, '\'');
+	}
+	buf_addstring(code, " }\n");
+}
+
+/*
+ * Map line of generated code to a template line, 0 if it has none, and
+ * set file to 0 for the template itself or the number of an inlined one.
+ */
+int
+lt_srcline(const char *map, size_t len, int line, int *file)
+{
+	const struct lt_line *r = (const struct lt_line *)map;
+	size_t lo, hi, mid;
+
+	/* Find the last run starting at or before line */
+	lo = 0;
+	hi = len / sizeof *r;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (r[mid].line <= (uint32_t)line)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return 0;
+	*file = r[lo - 1].file;
+	return r[lo - 1].tline + (line - r[lo - 1].line);
+}
+
+/*
+ * Replace the position in the syntax error message on top of the stack,
+ * from loading the code of template fnam, by the template position.
+ */
+void
+srcmap_remap(lua_State *L, struct lt_state *s, const char *fnam)
+{
+	struct buffer *runs = &s->map[0].runs;
+	const char *msg;
+	char *end;
+	size_t len;
+	long line;
+	int file;
+
+	msg = lua_tostring(L, -1);
+	lua_pushfstring(L, "[string \"%s\"]:", fnam);
+	len = lua_rawlen(L, -1);
+	if (msg == NULL || strncmp(msg, lua_tostring(L, -1), len)) {
+		lua_pop(L, 1);
+		return;
+	}
+	lua_pop(L, 1);
+	line = strtol(msg + len, &end, 10);
+	if (*end != ':' || (line = lt_srcline(runs->data, runs->size, line,
+	    &file)) == 0)
+		return;
+	lua_pushfstring(L, "[template \"%s\"]:%d:%s",
+	    file ? name(s, file) : fnam, (int)line, end + 1);
+	lua_remove(L, -2);
+}
+
+/*
+ * Replace the position in the error message on top of the stack by the
+ * template line of the innermost template function running, using the
+ * maps of the templates of the container at index container.
+ */
+void
+lt_where(lua_State *L, int container)
+{
+	lua_Debug ar;
+	const char *msg, *map;
+	size_t len, wlen;
+	int file, level, line, top;
+
+	top = lua_gettop(L);
+	if (lua_type(L, top) != LUA_TSTRING
+	    || !strncmp(lua_tostring(L, top), "[template \"", 11))
+		return;
+	for (level = 1; lua_getstack(L, level, &ar); level++) {
+		if (!lua_getinfo(L, "Sl", &ar) || ar.currentline <= 0)
+			continue;
+
+		/* The chunk of a template is named after it */
+		lua_getfield(L, container, "template");
+		if (lua_getfield(L, -1, ar.source) != LUA_TTABLE
+		    || lua_getfield(L, -1, "map") != LUA_TSTRING) {
+			lua_settop(L, top);
+			continue;
+		}
+		map = lua_tolstring(L, -1, &len);
+		if ((line = lt_srcline(map, len, ar.currentline, &file)) == 0) {
+			lua_settop(L, top);
+			continue;
+		}
+		if (file == 0)
+			lua_pushstring(L, ar.source);
+		else if (lua_getfield(L, -2, "inlined") != LUA_TTABLE
+		    || lua_rawgeti(L, -1, file) != LUA_TSTRING) {
+			lua_settop(L, top);
+			continue;
+		}
+
+		/* Drop the position of the generated code */
+		msg = lua_tostring(L, top);
+		luaL_where(L, level);
+		wlen = lua_rawlen(L, -1);
+		if (!strncmp(msg, lua_tostring(L, -1), wlen))
+			msg += wlen;
+		lua_pushfstring(L, "[template \"%s\"]:%d: %s",
+		    lua_tostring(L, -2), line, msg);
+		lua_replace(L, top);
+		lua_settop(L, top);
+		return;
+	}
+}
@@ -0,0 +1,260 @@
+/*
+ * Copyright (C) 2021 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Per template instrumentation.  The counters live in the stats table of
+ * the container, as userdata keyed by template name, so that they survive
+ * evictions.  The block counters of a template are kept in a table that
+ * is the user value of its counters.
+ *
+ * Allocations are only counted once a context asks for it with
+ * countAllocs(true).  They are counted for the whole Lua state, a render
+ * is charged with what was allocated between its start and its end,
+ * including what other coroutines allocated while it was suspended.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "buffer.h"
+#include "luatemplate.h"
+
+/* Nanoseconds on the monotonic clock */
+lua_Integer
+lt_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (lua_Integer)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#define LT_ALLOC_KEY	"Lua template allocation counters"
+
+static void *
+count_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+	struct lt_alloc *a = ud;
+	size_t old;
+
+	/* Without a block, osize is the type of the new object */
+	old = ptr != NULL ? osize : 0;
+	if (nsize > old) {
+		a->bytes += nsize - old;
+		a->allocs++;
+	}
+	return a->f(a->ud, ptr, osize, nsize);
+}
+
+/* Put the wrapped allocator back when the state is closed */
+static int
+restore_alloc(lua_State *L)
+{
+	struct lt_alloc *a;
+	void *ud;
+
+	a = lua_touserdata(L, 1);
+	if (lua_getallocf(L, &ud) == count_alloc && ud == a)
+		lua_setallocf(L, a->f, a->ud);
+	return 0;
+}
+
+/*
+ * The finalizer of a garbage userdata, called once per collection cycle
+ * of the state that reaches it.  It counts the cycle and leaves a new
+ * sentinel behind.
+ */
+static int
+gc_sentinel(lua_State *L)
+{
+	struct lt_alloc *a;
+
+	a = lua_touserdata(L, lua_upvalueindex(1));
+	a->collections++;
+	lua_newuserdata(L, 0);
+	lua_getmetatable(L, 1);
+	lua_setmetatable(L, -2);
+	lua_pop(L, 1);
+	return 0;
+}
+
+/*
+ * Return the allocation counters of the state, installing them the first
+ * time a context counts allocations.  They live in the registry, so the
+ * counting allocator stays valid until the state is closed.
+ */
+struct lt_alloc *
+lt_alloc(lua_State *L)
+{
+	struct lt_alloc *a;
+
+	if (lua_getfield(L, LUA_REGISTRYINDEX, LT_ALLOC_KEY) == LUA_TUSERDATA) {
+		a = lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		return a;
+	}
+	lua_pop(L, 1);
+
+	a = lua_newuserdata(L, sizeof(struct lt_alloc));
+	a->f = lua_getallocf(L, &a->ud);
+	a->bytes = a->allocs = a->collections = 0;
+	lua_createtable(L, 0, 1);
+	lua_pushcfunction(L, restore_alloc);
+	lua_setfield(L, -2, "__gc");
+	lua_setmetatable(L, -2);
+	lua_setfield(L, LUA_REGISTRYINDEX, LT_ALLOC_KEY);
+	lua_setallocf(L, count_alloc, a);
+
+	lua_newuserdata(L, 0);
+	lua_createtable(L, 0, 1);
+	lua_pushlightuserdata(L, a);
+	lua_pushcclosure(L, gc_sentinel, 1);
+	lua_setfield(L, -2, "__gc");
+	lua_setmetatable(L, -2);
+	lua_pop(L, 1);
+	return a;
+}
+
+/* Push the counters of template fnam stored in the table at index stats */
+static struct lt_stats *
+get_stats(lua_State *L, int stats, const char *fnam)
+{
+	struct lt_stats *st;
+
+	if (lua_getfield(L, stats, fnam) == LUA_TUSERDATA)
+		return lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	st = lua_newuserdata(L, sizeof(struct lt_stats));
+	memset(st, 0, sizeof(struct lt_stats));
+	lua_newtable(L);
+	lua_setuservalue(L, -2);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, stats, fnam);
+	return st;
+}
+
+/* Return the counters of template fnam of the container at index container */
+struct lt_stats *
+lt_stats(lua_State *L, int container, const char *fnam)
+{
+	struct lt_stats *st;
+
+	lua_getfield(L, container, "stats");
+	st = get_stats(L, lua_gettop(L), fnam);
+	lua_pop(L, 2);
+	return st;
+}
+
+/*
+ * Push the counters of block b of template t of the container at index
+ * container and return them.
+ */
+struct lt_block_stats *
+lt_block_stats(lua_State *L, int container, const char *t, const char *b)
+{
+	struct lt_block_stats *bs;
+
+	lua_getfield(L, container, "stats");
+	get_stats(L, lua_gettop(L), t);
+	lua_getuservalue(L, -1);
+	if (lua_getfield(L, -1, b) == LUA_TUSERDATA)
+		bs = lua_touserdata(L, -1);
+	else {
+		lua_pop(L, 1);
+		bs = lua_newuserdata(L, sizeof(struct lt_block_stats));
+		bs->count = bs->time = 0;
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -3, b);
+	}
+	lua_replace(L, -4);
+	lua_pop(L, 2);
+	return bs;
+}
+
+/* Push the counters of the container at index container as a table */
+void
+lt_push_stats(lua_State *L, int container)
+{
+	struct lt_stats *st;
+	struct lt_block_stats *bs;
+	int t;
+
+	lua_newtable(L);
+	t = lua_gettop(L);
+	lua_getfield(L, container, "stats");
+	lua_pushnil(L);
+	while (lua_next(L, t + 1)) {
+		st = lua_touserdata(L, -1);
+		lua_pushvalue(L, -2);
+		lua_createtable(L, 0, 11);
+		lua_pushinteger(L, st->compiles);
+		lua_setfield(L, -2, "compiles");
+		lua_pushnumber(L, st->compile_time / 1e9);
+		lua_setfield(L, -2, "compileTime");
+		lua_pushinteger(L, st->renders);
+		lua_setfield(L, -2, "renders");
+		lua_pushnumber(L, st->render_time / 1e9);
+		lua_setfield(L, -2, "renderTime");
+		lua_pushnumber(L, st->render_max / 1e9);
+		lua_setfield(L, -2, "renderMax");
+		lua_pushinteger(L, st->bytes);
+		lua_setfield(L, -2, "bytes");
+		lua_pushinteger(L, st->sink_calls);
+		lua_setfield(L, -2, "sinkCalls");
+		lua_pushinteger(L, st->alloc_bytes);
+		lua_setfield(L, -2, "allocBytes");
+		lua_pushinteger(L, st->allocs);
+		lua_setfield(L, -2, "allocs");
+		lua_pushinteger(L, st->collections);
+		lua_setfield(L, -2, "collections");
+
+		lua_newtable(L);
+		lua_getuservalue(L, -4);
+		lua_pushnil(L);
+		while (lua_next(L, -2)) {
+			bs = lua_touserdata(L, -1);
+			lua_pushvalue(L, -2);
+			lua_createtable(L, 0, 2);
+			lua_pushinteger(L, bs->count);
+			lua_setfield(L, -2, "count");
+			lua_pushnumber(L, bs->time / 1e9);
+			lua_setfield(L, -2, "time");
+			lua_rawset(L, -6);
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+		lua_setfield(L, -2, "blocks");
+
+		lua_rawset(L, t);
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2021 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * A process wide store of compiled templates, shared by all Lua states of
+ * a threaded program.  The store holds the same serialized form as the
+ * bytecode cache, keyed like it by template path, name, search roots and
+ * compile options, and checked against the modification time and size.
+ * Stored data is never modified, only replaced, so readers just need to
+ * hold the read lock while loading.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "buffer.h"
+#include "luatemplate.h"
+
+#define STORE_BUCKETS	256
+
+struct blob {
+	SLIST_ENTRY(blob)	 next;
+	char			*path;
+	char			*fnam;
+	uint64_t		 roots;		/* lt_roots_hash() */
+	time_t			 mtime;
+	off_t			 size;
+	int			 options;
+	size_t			 len;
+	char			 data[];
+};
+
+static SLIST_HEAD(, blob) store[STORE_BUCKETS];
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static struct blob *
+lookup(size_t bucket, const char *path, const char *fnam, uint64_t roots,
+    int options)
+{
+	struct blob *b;
+
+	SLIST_FOREACH(b, &store[bucket], next)
+		if (b->roots == roots && b->options == options
+		    && !strcmp(b->path, path) && !strcmp(b->fnam, fnam))
+			return b;
+	return NULL;
+}
+
+static void
+free_blob(struct blob *b)
+{
+	free(b->path);
+	free(b->fnam);
+	free(b);
+}
+
+/*
+ * Push the compiled template of path, found as fnam on the search roots
+ * and compiled with options, from the store.  Returns -1 if the store has
+ * no current version of the template.
+ */
+int
+store_load(lua_State *L, const char *path, const char *fnam, char **roots,
+    struct stat *sb, struct lt_include_head *includes, int options)
+{
+	struct blob *b;
+	const char *p;
+	size_t bucket;
+	int rv;
+
+	rv = -1;
+	bucket = lt_code_key(path, fnam, roots, options) % STORE_BUCKETS;
+	pthread_rwlock_rdlock(&lock);
+	if ((b = lookup(bucket, path, fnam, lt_roots_hash(roots), options))
+	    != NULL && b->mtime == sb->st_mtime
+	    && b->size == sb->st_size) {
+		p = b->data;
+		rv = lt_undump(L, &p, b->data + b->len, includes);
+	}
+	pthread_rwlock_unlock(&lock);
+	return rv;
+}
+
+/*
+ * Add the compiled template on top of the stack to the store, replacing
+ * an older version.  Errors are ignored, the template is just compiled
+ * again next time.
+ */
+void
+store_add(lua_State *L, const char *path, const char *fnam, char **roots,
+    struct stat *sb, struct lt_include_head *includes, int options)
+{
+	struct buffer buf;
+	struct blob *b, *old;
+	size_t bucket;
+
+	if (buf_init(&buf))
+		return;
+	if (lt_dump(L, &buf, includes) || buf.error)
+		goto out;
+	if ((b = malloc(sizeof(struct blob) + buf.size)) == NULL)
+		goto out;
+	b->path = strdup(path);
+	b->fnam = strdup(fnam);
+	if (b->path == NULL || b->fnam == NULL) {
+		free_blob(b);
+		goto out;
+	}
+	b->roots = lt_roots_hash(roots);
+	b->mtime = sb->st_mtime;
+	b->size = sb->st_size;
+	b->options = options;
+	b->len = buf.size;
+	memcpy(b->data, buf.data, buf.size);
+
+	bucket = lt_code_key(path, fnam, roots, options) % STORE_BUCKETS;
+	pthread_rwlock_wrlock(&lock);
+	if ((old = lookup(bucket, path, fnam, b->roots, options)) != NULL)
+		SLIST_REMOVE(&store[bucket], old, blob, next);
+	SLIST_INSERT_HEAD(&store[bucket], b, next);
+	pthread_rwlock_unlock(&lock);
+
+	if (old != NULL)
+		free_blob(old);
+out:
+	buf_free(&buf);
+}
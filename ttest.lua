@@ -22,3 +22,675 @@ data.title = 'Hello, world, again!'
 
 -- render a second time
 ctx:renderFile(arg[1] or 'sample.lt', data)
+
+-- render into a string using the native output buffer
+data.title = 'Hello, string!'
+io.write(ctx:renderToString(arg[1] or 'sample.lt', data))
+
+-- Behavior checks, on templates written to work/
+os.execute('mkdir -p work/views/sub')
+
+local function write(name, text)
+	local f = assert(io.open('work/' .. name, 'w'))
+	f:write(text)
+	f:close()
+	return 'work/' .. name
+end
+
+local function renderString(ctx, name, text, env)
+	local out = {}
+	ctx:renderString(name, text, env or data, function (s)
+		out[#out + 1] = s
+	end)
+	return table.concat(out)
+end
+
+local function fails(f, ...)
+	local ok, msg = pcall(f, ...)
+	assert(not ok)
+	return msg
+end
+
+-- set the modification time of a file to t, which may be in the future
+local function touch(path, t)
+	assert(os.execute(string.format('touch -t %s %s',
+	    os.date('%Y%m%d%H%M.%S', t), path)))
+end
+
+-- escaping gives the same bytes as substituting each entity in turn
+do
+	local entities = {
+		html = { ['&'] = '&amp;', ['<'] = '&lt;', ['>'] = '&gt;',
+		    ['"'] = '&#034;', ["'"] = '&#039;' },
+		xml = { ['&'] = '&amp;', ['<'] = '&lt;', ['>'] = '&gt;',
+		    ['"'] = '&quot;', ["'"] = '&apos;' },
+		latex = { ['&'] = '\\&', ['$'] = '\\$',
+		    ['\\'] = '$\\backslash$', ['_'] = '\\_', ['<'] = '$<$',
+		    ['>'] = '$>$', ['%'] = '\\%', ['#'] = '\\#', ['^'] = '$^$' },
+		url = {},
+	}
+	for c in (' <>#%{}|\\^~[]`;/?:@=&$'):gmatch('.') do
+		entities.url[c] = string.format('%%%02X', c:byte())
+	end
+	local bytes = {}
+	for c = 0, 255 do
+		bytes[#bytes + 1] = string.char(c)
+	end
+	bytes = table.concat(bytes)
+	local s = bytes .. string.rep('clean text ', 50) .. bytes .. '&'
+	local ctx = template.context()
+	for mode, t in pairs(entities) do
+		local out = renderString(ctx, mode, '<%= escape_' .. mode
+		    .. '(s) %>', { s = s })
+		assert(out == (s:gsub('.', t)))
+	end
+end
+
+-- a second context loads what the first one compiled from the cache
+do
+	os.execute('rm -rf work/cache && mkdir -p work/cache')
+	local src = write('cached.lt', 'cached <%= b %>')
+	local ctx = template.context()
+	ctx:cacheDir('work/cache')
+	assert(ctx:renderToString(src, data) == 'cached 42')
+
+	-- the cached code is used as long as the file looks the same
+	os.execute('cp -p ' .. src .. ' work/cached.ref')
+	write('cached.lt', 'CACHED <%= b %>')
+	os.execute('touch -r work/cached.ref ' .. src)
+	ctx = template.context()
+	ctx:cacheDir('work/cache')
+	assert(ctx:renderToString(src, data) == 'cached 42')
+	assert(template.context():renderToString(src, data) == 'CACHED 42')
+
+	-- code compiled under another name is not
+	ctx = template.context()
+	ctx:cacheDir('work/cache')
+	ctx:searchPath({ 'work' })
+	assert(ctx:renderToString('cached.lt', data) == 'CACHED 42')
+end
+
+-- templates compiled by ltc into a bundle render without their files
+local ltc = io.open('ltc')
+if ltc then
+	ltc:close()
+	os.execute('rm -rf work/bundle && mkdir -p work/bundle/sub')
+	write('bundle/base.lt', '<<%! block t %>base<%! endblock %>>')
+	write('bundle/sub/part.lt', 'part <%= b %>')
+	write('bundle/page.lt', '<%! extends base.lt %>'
+	    .. '<%! block t %><%! include sub/part.lt %>!<%! endblock %>')
+	assert(os.execute('./ltc -o work/t.ltb work/bundle'))
+	os.execute('rm -rf work/bundle')
+	local ctx = template.context()
+	ctx:loadBundle('work/t.ltb')
+	assert(ctx:renderToString('page.lt', data) == '<part 42!>')
+	assert(ctx:renderToString('sub/part.lt', { b = 1 }) == 'part 1')
+	assert(ctx:stats()['page.lt'].compiles == 0)
+end
+
+-- an edited include is picked up once the revalidation interval is over
+do
+	local part = write('reval-part.lt', 'old')
+	write('reval.lt', '[<%! include ' .. part .. ' %>]')
+	local ctx = template.context()
+	ctx:revalidate(500)
+	assert(ctx:renderToString('work/reval.lt', data) == '[old]')
+	write('reval-part.lt', 'new')
+	touch(part, os.time() + 2)
+	assert(ctx:renderToString('work/reval.lt', data) == '[old]')
+	os.execute('sleep 0.6')
+	assert(ctx:renderToString('work/reval.lt', data) == '[new]')
+	assert(ctx:stats()['work/reval.lt'].compiles == 2)
+end
+
+-- watched templates are invalidated by file system events
+do
+	os.execute('rm -rf work/wover work/wbase && mkdir -p work/wbase')
+	write('wbase/w.lt', 'base')
+	local ctx = template.context()
+	ctx:searchPath({ 'work/wover', 'work/wbase' })
+	ctx:watch(true)
+	assert(ctx:renderToString('w.lt', data) == 'base')
+	write('wbase/w.lt', 'edit')
+	assert(ctx:renderToString('w.lt', data) == 'edit')
+
+	-- also by overrides in a directory that did not exist
+	os.execute('mkdir -p work/wover')
+	write('wover/w.lt', 'over')
+	assert(ctx:renderToString('w.lt', data) == 'over')
+	ctx:watch(false)
+end
+
+-- rendering leaves the table of the caller as it was
+do
+	local env = { b = 42, s = '<' }
+	write('env-part.lt', '<%=html s %>')
+	local ctx = template.context()
+	assert(renderString(ctx, 'env', '<%! block x %><%= b %><%! endblock %>'
+	    .. '<%! include work/env-part.lt %><%=%d b %>', env) == '42&lt;42')
+	local keys = {}
+	for k in pairs(env) do
+		keys[#keys + 1] = k
+	end
+	table.sort(keys)
+	assert(table.concat(keys, ',') == 'b,s' and getmetatable(env) == nil)
+end
+
+-- output is passed on in chunks, to functions and to files
+do
+	local src = write('chunks.lt', string.rep('x', 100)
+	    .. '<% for i = 1, 20 do %><%= i %>,<% end %>')
+	local ctx = template.context()
+	local expect = ctx:renderToString(src, data)
+	local out = {}
+	ctx:renderFile(src, data, function (s) out[#out + 1] = s end)
+	assert(#out == 1 and out[1] == expect)
+	ctx:bufferSize(16)
+	out = {}
+	ctx:renderFile(src, data, function (s) out[#out + 1] = s end)
+	assert(#out > 4 and table.concat(out) == expect)
+
+	local f = assert(io.open('work/chunks.out', 'w'))
+	ctx:renderFile(src, data, f)
+	f:close()
+	f = assert(io.open('work/chunks.out'))
+	assert(f:read('a') == expect)
+	f:close()
+end
+
+-- templates from memory are compiled again when their source changes
+do
+	local ctx = template.context()
+	assert(renderString(ctx, 'mem', 'one <%= b %>') == 'one 42')
+	assert(renderString(ctx, 'mem', 'one <%= b %>') == 'one 42')
+	assert(ctx:stats().mem.compiles == 1)
+	assert(ctx:cacheStats().hits == 1)
+	assert(renderString(ctx, 'mem', 'two <%= b %>') == 'two 42')
+	assert(ctx:stats().mem.compiles == 2)
+
+	-- and so is what includes them
+	assert(renderString(ctx, 'base', 'B1') == 'B1')
+	assert(renderString(ctx, 'page', '[<%! include base %>]') == '[B1]')
+	assert(renderString(ctx, 'base', 'B2') == 'B2')
+	assert(renderString(ctx, 'page', '[<%! include base %>]') == '[B2]')
+	assert(ctx:stats().page.compiles == 2)
+end
+
+-- the least recently used templates are evicted first
+do
+	os.execute('mkdir -p work/lru')
+	local a = write('lru/a.lt', 'aaaa')
+	local b = write('lru/b.lt', 'bbbb')
+	local c = write('lru/c.lt', 'cccc')
+	local ctx = template.context()
+	ctx:cacheLimit(2)
+	assert(ctx:renderToString(a, data) == 'aaaa')
+	assert(ctx:renderToString(b, data) == 'bbbb')
+	assert(ctx:renderToString(c, data) == 'cccc')
+	local cs = ctx:cacheStats()
+	assert(cs.templates == 2 and cs.misses == 3 and cs.evictions == 1)
+	assert(ctx:renderToString(b, data) == 'bbbb')
+	assert(ctx:renderToString(a, data) == 'aaaa')
+	assert(ctx:renderToString(b, data) == 'bbbb')
+	cs = ctx:cacheStats()
+	assert(cs.hits == 2 and cs.misses == 4 and cs.evictions == 2)
+	local st = ctx:stats()
+	assert(st[a].compiles == 2 and st[b].compiles == 1)
+	assert(st[c].compiles == 1)
+
+	-- by the size of their source
+	ctx = template.context()
+	ctx:cacheLimit(0, 10)
+	ctx:renderToString(a, data)
+	ctx:renderToString(b, data)
+	ctx:renderToString(c, data)
+	cs = ctx:cacheStats()
+	assert(cs.templates == 2 and cs.bytes == 8 and cs.evictions == 1)
+end
+
+-- the templates of a render in progress are not evicted under it
+do
+	local base = write('lru/base.lt',
+	    '<<%! block t %>base<%! endblock %>>')
+	local child = write('lru/child.lt', '<%! extends ' .. base .. ' %>'
+	    .. '<%! block t %>child <%! include work/lru/a.lt %><%! endblock %>')
+	local ctx = template.context()
+	ctx:cacheLimit(1)
+	for _ = 1, 3 do
+		assert(ctx:renderToString(child, data) == '<child aaaa>')
+		assert(ctx:renderToString('work/lru/b.lt', data) == 'bbbb')
+	end
+	local cs = ctx:cacheStats()
+	assert(cs.templates == 1 and cs.evictions > 0)
+end
+
+-- an evicted include leaves what inlined it alone, until it changes
+do
+	write('lru/i.lt', 'iiii')
+	local p = write('lru/p.lt', '<%! include work/lru/i.lt %>!')
+	local ctx = template.context()
+	ctx:inline(true)
+	ctx:cacheLimit(2)
+	ctx:revalidate(0)
+	assert(ctx:renderToString(p, data) == 'iiii!')
+	assert(ctx:renderToString('work/lru/b.lt', data) == 'bbbb')
+	assert(ctx:cacheStats().evictions == 1)
+	assert(ctx:renderToString(p, data) == 'iiii!')
+	assert(ctx:stats()[p].compiles == 1)
+	write('lru/i.lt', 'IIII')
+	touch('work/lru/i.lt', os.time() + 60)
+	assert(ctx:renderToString(p, data) == 'IIII!')
+	assert(ctx:stats()[p].compiles == 2)
+end
+
+-- contexts sharing templates load what another one compiled
+do
+	local src = write('shared.lt', 'shared <%= b %>')
+	local ctx = template.context()
+	ctx:shareTemplates(true)
+	assert(ctx:renderToString(src, data) == 'shared 42')
+
+	os.execute('cp -p ' .. src .. ' work/shared.ref')
+	write('shared.lt', 'SHARED <%= b %>')
+	os.execute('touch -r work/shared.ref ' .. src)
+	ctx = template.context()
+	ctx:shareTemplates(true)
+	assert(ctx:renderToString(src, data) == 'shared 42')
+	assert(template.context():renderToString(src, data) == 'SHARED 42')
+
+	-- but not under another name or with other compile options
+	ctx = template.context()
+	ctx:shareTemplates(true)
+	ctx:searchPath({ 'work' })
+	assert(ctx:renderToString('shared.lt', data) == 'SHARED 42')
+	ctx = template.context()
+	ctx:shareTemplates(true)
+	ctx:inline(true)
+	assert(ctx:renderToString(src, data) == 'SHARED 42')
+end
+
+-- preloaded templates are named relative to their search root
+do
+	write('views/sub/item.lt', 'item <%= b %>')
+	local ctx = template.context()
+	ctx:searchPath({ 'work/views', '' })
+	ctx:preload('work/views')
+	assert(ctx:renderToString('sub/item.lt', data) == 'item 42')
+	local st = ctx:stats()['sub/item.lt']
+	assert(st.compiles == 1 and st.renders == 1)
+end
+
+-- templates and blocks without code print their text unchanged
+do
+	local text = 'static ]] ]=] text\n\n]'
+	local page = write('static.lt', text)
+	local ctx = template.context()
+	assert(ctx:renderToString(page, data) == text)
+	assert(renderString(ctx, 'static', text) == text)
+
+	local base = write('static-base.lt',
+	    '<<%! block a %>base a<%! endblock %>|'
+	    .. '<%! block b %>base b<%! endblock %>>')
+	local child = write('static-child.lt', '<%! extends ' .. base .. ' %>'
+	    .. '<%! block b %>child ]] b<%! endblock %>')
+	assert(ctx:renderToString(base, data) == '<base a|base b>')
+	assert(ctx:renderToString(child, data) == '<base a|child ]] b>')
+	local inc = write('static-inc.lt', '[<%! include ' .. page .. ' %>]')
+	assert(ctx:renderToString(inc, data) == '[' .. text .. ']')
+end
+
+-- cached fragments are replayed until they expire
+do
+	local ctx = template.context()
+	local text = '<%! cache "k" 60 %>[<%= n %>]<%! endcache %><%= n %>'
+	assert(renderString(ctx, 'frag', text, { n = 1 }) == '[1]1')
+	assert(renderString(ctx, 'frag', text, { n = 2 }) == '[1]2')
+	local cs = ctx:cacheStats()
+	assert(cs.fragmentHits == 1 and cs.fragmentMisses == 1)
+	assert(cs.fragmentBytes == 3)
+
+	text = '<%! cache "now" 0 %>[<%= n %>]<%! endcache %>'
+	assert(renderString(ctx, 'expired', text, { n = 1 }) == '[1]')
+	assert(renderString(ctx, 'expired', text, { n = 2 }) == '[2]')
+
+	-- a failed region is not cached
+	text = '<%! cache "e" 60 %><% if fail then error("no") end %>ok'
+	    .. '<%! endcache %>'
+	fails(renderString, ctx, 'failed', text, { fail = true, error = error })
+	assert(renderString(ctx, 'failed', text, { error = error }) == 'ok')
+	assert(renderString(ctx, 'failed', text, { fail = true }) == 'ok')
+
+	-- nothing is cached without room
+	ctx:fragmentLimit(0)
+	assert(ctx:cacheStats().fragmentBytes == 0)
+	assert(renderString(ctx, 'frag', text, { n = 3 }) == 'ok')
+	text = '<%! cache "k" 60 %>[<%= n %>]<%! endcache %>'
+	assert(renderString(ctx, 'frag', text, { n = 3 }) == '[3]')
+	assert(renderString(ctx, 'frag', text, { n = 4 }) == '[4]')
+	-- the least recently used fragments make room first
+	ctx:fragmentLimit(6)
+	local function frag(k, n)
+		return renderString(ctx, 'frag-' .. k, '<%! cache "' .. k
+		    .. '" 60 %>[<%= n %>]<%! endcache %>', { n = n })
+	end
+	assert(frag('a', 1) == '[1]' and frag('b', 1) == '[1]')
+	assert(frag('a', 2) == '[1]')
+	assert(frag('c', 1) == '[1]')
+	assert(ctx:cacheStats().fragmentBytes == 6)
+	assert(frag('a', 3) == '[1]' and frag('c', 3) == '[1]')
+	assert(frag('b', 3) == '[3]')
+end
+
+-- renders and the blocks they call are counted per template
+do
+	local base = write('stats-base.lt',
+	    '<<%! block a %>a<%= b %><%! endblock %>'
+	    .. '<%! block s %>static<%! endblock %>>')
+	local child = write('stats-child.lt', '<%! extends ' .. base .. ' %>'
+	    .. '<%! block s %>child<%! endblock %>')
+	local ctx = template.context()
+	for _ = 1, 3 do
+		assert(ctx:renderToString(child, data) == '<a42child>')
+	end
+	assert(ctx:renderToString(base, data) == '<a42static>')
+	local st = ctx:stats()
+	assert(st[child].compiles == 1 and st[child].renders == 3)
+	assert(st[child].bytes == 30 and st[child].renderTime >= 0)
+	assert(st[child].blocks.a.count == 3 and st[child].blocks.s.count == 3)
+	assert(st[base].renders == 1 and st[base].blocks.a.count == 1)
+
+	-- counting starts over after a reset
+	ctx:resetStats()
+	assert(next(ctx:stats()) == nil)
+	assert(ctx:renderToString(child, data) == '<a42child>')
+	st = ctx:stats()
+	assert(st[child].compiles == 0 and st[child].renders == 1)
+	assert(st[child].blocks.a.count == 1)
+end
+
+-- simple conversions are formatted natively, others by string.format()
+do
+	local ctx = template.context()
+	local env = { b = 42, x = 1.5, s = '<b>' }
+	assert(renderString(ctx, 'd', '<%=%5d b %>', env) == '   42')
+	assert(renderString(ctx, 'x', '<%=%x b %>', env) == '2a')
+	assert(renderString(ctx, 'f', '<%=%6.2f x %>', env) == '  1.50')
+	assert(renderString(ctx, 's', '<%=%s s %>', env) == '<b>')
+	assert(renderString(ctx, 'pad', '<%=%05d b %>|<%=%-4d b %>|', env)
+	    == '00042|42  |')
+	assert(renderString(ctx, 'html', '<%!escape html %><%=%s s %>', env)
+	    == '&lt;b&gt;')
+end
+
+-- <%- trims, <%-- is a comment
+do
+	local ctx = template.context()
+	assert(renderString(ctx, 'comment', 'a<%-- note %>b') == 'ab')
+	assert(renderString(ctx, 'trim', 'a \n<%- x = 1 -%>\n b') == 'ab')
+	assert(renderString(ctx, 'expr', 'a <%-= b -%> c') == 'a42c')
+end
+
+-- minifying collapses whitespace and drops blank lines between tags
+do
+	local ctx = template.context()
+	local text = '<p>  a   b  </p>\n\n  <p>c</p><% x = 1 %>\n  \n'
+	    .. '<% x = 2 %>d<% x = 3 %>  <% x = 4 %>e'
+	local minified = '<p> a b </p>\n<p>c</p>d e'
+	assert(renderString(ctx, 'm', '<%! minify html %>' .. text, {})
+	    == minified)
+	assert(renderString(ctx, 'm', text, {}) ~= minified)
+	ctx:minify(true)
+	assert(renderString(ctx, 'm', text, {}) == minified)
+	assert(renderString(ctx, 'off', '<%! minify none %>a  b') == 'a  b')
+end
+
+-- compressed output inflates to what is rendered without compression
+do
+	local big = string.rep('static text ', 200)
+	write('gzinc.lt', big .. '<%= b %>')
+	local text = big .. '<%= b %>\n' .. big
+	    .. '<%! include work/gzinc.lt %><% for i = 1, 3 do %><%= i %><% end %>'
+	local plain = renderString(template.context(), 'gz', text)
+	assert(#plain > 3 * #big)
+
+	local function gunzip(s)
+		local f = assert(io.open('work/out.gz', 'wb'))
+		f:write(s)
+		f:close()
+		local p = assert(io.popen('gzip -dc work/out.gz'))
+		s = p:read('a')
+		p:close()
+		return s
+	end
+	local ctx = template.context()
+	ctx:bufferSize(64)
+	ctx:compress(true)
+	local z = renderString(ctx, 'gz', text)
+	assert(z:sub(1, 2) == '\31\139' and #z < #plain)
+	assert(gunzip(z) == plain)
+	-- the second time, the static literals are already compressed
+	local z2 = renderString(ctx, 'gz', text)
+	assert(gunzip(z .. z2) == plain .. plain)
+	ctx:compress(9)
+	assert(gunzip(renderString(ctx, 'gz', text)) == plain)
+	ctx:compress(false)
+	assert(renderString(ctx, 'gz', text) == plain)
+end
+
+-- coroutines render with the same context independently
+do
+	local ctx = template.context()
+	write('co.lt', '<%= b %>|<%= b %>')
+	ctx:bufferSize(1)
+	local function start()
+		local out = {}
+		local co = coroutine.wrap(function ()
+			ctx:renderFile('work/co.lt', data, function (s)
+				out[#out + 1] = s
+				coroutine.yield()
+			end)
+			return 'done'
+		end)
+		co()	-- suspended in its first sink call
+		return co, out
+	end
+	local a, aout = start()
+	local b, bout = start()
+	start()	-- never resumed
+	while a() ~= 'done' do end
+	while b() ~= 'done' do end
+	assert(table.concat(aout) == '42|42')
+	assert(table.concat(bout) == '42|42')
+	assert(ctx:renderToString('work/co.lt', data) == '42|42')
+end
+
+-- errors are reported at the template line they occur on
+do
+	local ctx = template.context()
+	local env = { b = 42, error = error }
+	local msg = fails(renderString, ctx, 'err',
+	    'a\n<%= b\n %>\n\n<% error("late") %>', env)
+	assert(msg:find('[template "err"]:5: late', 1, true))
+	msg = fails(renderString, ctx, 'syntax', 'a\n\n<% if then %>', env)
+	assert(msg:find('[template "syntax"]:3:', 1, true))
+end
+
+-- sinks may yield in the middle of a batch, too
+do
+	local ctx = template.context()
+	local row = write('row.lt', '<%= b %>')
+	local rows = { { b = 1 }, { b = 2 }, { b = 3 } }
+	ctx:bufferSize(1)
+	local out, yields = {}, 0
+	local co = coroutine.wrap(function ()
+		ctx:renderBatch(row, rows, function (s)
+			out[#out + 1] = s
+			coroutine.yield()
+		end, ', ')
+		return 'done'
+	end)
+	while co() ~= 'done' do
+		yields = yields + 1
+	end
+	assert(table.concat(out) == '1, 2, 3' and yields > 3)
+
+	-- and row callbacks with them
+	out = {}
+	co = coroutine.wrap(function ()
+		ctx:renderBatch(row, rows, nil, function (s, n)
+			out[#out + 1] = s .. '#' .. n
+			coroutine.yield()
+		end)
+		return 'done'
+	end)
+	while co() ~= 'done' do end
+	assert(table.concat(out, ' ') == '1#1 2#2 3#3')
+
+	-- rows may come from an iterator
+	local n = 0
+	local function iter()
+		n = n + 1
+		return n <= 3 and { b = n * 10 } or nil
+	end
+	out = {}
+	ctx:renderBatch(row, iter, function (s) out[#out + 1] = s end, '')
+	assert(table.concat(out) == '102030')
+
+	-- which may yield as well
+	n = 0
+	local function pull()
+		n = n + 1
+		coroutine.yield()
+		return n <= 3 and { b = n } or nil
+	end
+	yields = 0
+	co = coroutine.wrap(function ()
+		ctx:renderBatch(row, pull, function (s)
+			out[#out + 1] = s
+		end, '-')
+		return 'done'
+	end)
+	out = {}
+	while co() ~= 'done' do
+		yields = yields + 1
+	end
+	assert(table.concat(out) == '1-2-3' and yields == 4)
+	assert(ctx:renderToString(row, data) == '42')
+	local msg = fails(ctx.renderBatch, ctx, row, { 1 }, function () end)
+	assert(msg:find('row 1 is not a table', 1, true))
+end
+
+-- inlined includes render like included ones, errors point into them
+do
+	os.execute('mkdir -p work/inc')
+	local part = write('inc/part.lt', 'part <%= b %> '
+	    .. '<%= debug.getinfo(1, "S").source %><%\n'
+	    .. 'if fail then error("bang") end %>')
+	local page = write('inc/page.lt', '[<%! include ' .. part .. ' %>]')
+	local env = { b = 42, debug = debug, error = error }
+	local ctx = template.context()
+	local inlined = template.context()
+	inlined:inline(true)
+	assert(ctx:renderToString(page, env) == '[part 42 ' .. part .. ']')
+	assert(inlined:renderToString(page, env) == '[part 42 ' .. page .. ']')
+	env.fail = true
+	for _, c in ipairs({ ctx, inlined }) do
+		local msg = fails(c.renderToString, c, page, env)
+		assert(msg:find('[template "' .. part .. '"]:2: bang', 1, true))
+	end
+	env.fail = nil
+
+	-- changing the include compiles the page again
+	write('inc/part.lt', 'PART')
+	touch(part, os.time() + 2)
+	assert(inlined:renderToString(page, env) == '[PART]')
+	assert(inlined:stats()[page].compiles == 2)
+	-- recursion is an error, which leaves the templates involved usable
+	local a = write('inc/a.lt', 'a<%! include work/inc/b.lt %>')
+	write('inc/b.lt', 'b<%! include work/inc/a.lt %>')
+	for _, c in ipairs({ ctx, inlined }) do
+		local msg = fails(c.renderToString, c, a, env)
+		assert(msg:find('recursion detected', 1, true))
+	end
+	write('inc/b.lt', 'b')
+	for _, c in ipairs({ ctx, inlined }) do
+		assert(c:renderToString(a, env) == 'ab')
+	end
+end
+
+-- escaped expressions print what the escape functions return
+do
+	local ctx = template.context()
+	local env = { s = '<a href="x?a=1&b=2">$_%#^ \'\\\'</a>', n = 1.5,
+	    i = -42 }
+	for _, mode in ipairs({ 'html', 'xml', 'url', 'latex' }) do
+		for _, v in ipairs({ 's', 'n', 'i' }) do
+			local want = renderString(ctx, mode .. v .. 'ref',
+			    '<%= escape_' .. mode .. '(' .. v .. ') %>', env)
+			assert(renderString(ctx, mode .. v, '<%=' .. mode .. ' '
+			    .. v .. ' %>', env) == want)
+			assert(renderString(ctx, mode .. v .. 'region',
+			    '<%!escape ' .. mode .. ' %><%= ' .. v .. ' %>',
+			    env) == want)
+		end
+	end
+	assert(renderString(ctx, 'num', '<%=html n %>|<%=url i %>', env)
+	    == '1.5|-42')
+end
+
+-- where a template was found is remembered until it goes away
+do
+	os.execute('mkdir -p work/t1 work/t2')
+	local ctx = template.context()
+	ctx:searchPath({ 'work/t1', 'work/t2' })
+	write('t2/x.lt', 'two')
+	assert(ctx:renderToString('x.lt', data) == 'two')
+	write('t1/x.lt', 'one')
+	assert(ctx:renderToString('x.lt', data) == 'two')
+	os.remove('work/t2/x.lt')
+	assert(ctx:renderToString('x.lt', data) == 'one')
+
+	-- and a template not found is not looked for again for a while
+	os.remove('work/t1/late.lt')
+	ctx:revalidate(60000)
+	fails(ctx.renderToString, ctx, 'late.lt', data)
+	write('t1/late.lt', 'late')
+	fails(ctx.renderToString, ctx, 'late.lt', data)
+	ctx:revalidate(0)
+	assert(ctx:renderToString('late.lt', data) == 'late')
+	os.remove('work/t1/x.lt')
+end
+
+-- native modules built by ltc -c render like compiled templates
+if ltc then
+	os.execute('mkdir -p work/native/work')
+	local src = write('nat.lt', '\r\nA\r\n<%= b %>\r\n')
+	local so = 'work/native/' .. src .. '.so'
+	local function build()
+		assert(os.execute(string.format(
+		    './ltc -c -o %s.c %s && cc -shared -fPIC -O2 -o %s %s.c',
+		    so, src, so, so)))
+	end
+	build()
+	local ctx = template.context()
+	assert(ctx:renderToString(src, data) == 'A\n42')
+	ctx = template.context()
+	ctx:nativeDir('work/native')
+	assert(ctx:renderToString(src, data) == 'A\n42')
+
+	-- the module is used as long as it was built from the file
+	os.execute('cp -p ' .. src .. ' work/nat.ref')
+	write('nat.lt', '\r\nZ\r\n<%= b %>\r\n')
+	os.execute('touch -r work/nat.ref ' .. src)
+	ctx = template.context()
+	ctx:nativeDir('work/native')
+	assert(ctx:renderToString(src, data) == 'A\n42')
+	assert(template.context():renderToString(src, data) == 'Z\n42')
+
+	-- a rebuilt module replaces the one loaded before
+	write('nat.lt', 'rebuilt <%= b %>')
+	build()
+	ctx = template.context()
+	ctx:nativeDir('work/native')
+	assert(ctx:renderToString(src, data) == 'rebuilt 42')
+end
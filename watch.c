@@ -0,0 +1,354 @@
+/*
+ * Copyright (C) 2021 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Template invalidation driven by file system events.  The directories
+ * that process_file() looks in, including the custom/ overrides, are
+ * watched, and changes evict the affected templates before the next
+ * render.  A directory that does not exist yet is waited for in its
+ * nearest existing parent.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#define LT_INOTIFY
+#elif defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) \
+    || defined(__APPLE__)
+#include <sys/event.h>
+#define LT_KQUEUE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "buffer.h"
+#include "luatemplate.h"
+
+int
+lt_watch_start(struct render_context *ctx)
+{
+#if defined(LT_INOTIFY)
+	ctx->wfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#elif defined(LT_KQUEUE)
+	ctx->wfd = kqueue();
+#else
+	errno = EOPNOTSUPP;
+#endif
+	return ctx->wfd == -1 ? -1 : 0;
+}
+
+static void
+free_watch(struct lt_watch *w)
+{
+	free(w->path);
+	free(w->name);
+	free(w->target);
+	free(w);
+}
+
+void
+lt_watch_stop(struct render_context *ctx)
+{
+	struct lt_watch *w;
+
+	while (!SLIST_EMPTY(&ctx->watches)) {
+		w = SLIST_FIRST(&ctx->watches);
+		SLIST_REMOVE_HEAD(&ctx->watches, next);
+#ifdef LT_KQUEUE
+		close(w->wd);
+#endif
+		free_watch(w);
+	}
+	if (ctx->wfd != -1)
+		close(ctx->wfd);
+	ctx->wfd = -1;
+}
+
+/* Put the nearest existing parent directory of path into parent */
+static void
+nearest_parent(char *parent, size_t len, const char *path)
+{
+	struct stat sb;
+	char *p;
+
+	snprintf(parent, len, "%s", path);
+	do {
+		if ((p = strrchr(parent, '/')) == NULL) {
+			snprintf(parent, len, ".");
+			return;
+		}
+		if (p == parent)
+			p++;
+		*p = '\0';
+	} while (stat(parent, &sb) && strcmp(parent, "/"));
+}
+
+/*
+ * Watch path, which is either a directory holding templates named
+ * name/..., or, with kqueue, the template file name itself.  If the
+ * directory does not exist, its nearest existing parent is watched until
+ * it does.
+ */
+static void
+watch_path(struct render_context *ctx, const char *path, const char *name,
+    int isdir)
+{
+	struct lt_watch *w;
+	struct stat sb;
+	char parent[PATH_MAX];
+	const char *target;
+	int wd;
+#ifdef LT_KQUEUE
+	struct kevent ev;
+#endif
+
+	target = NULL;
+	if (isdir && stat(path, &sb)) {
+		nearest_parent(parent, sizeof parent, path);
+		target = path;
+		path = parent;
+	}
+	SLIST_FOREACH(w, &ctx->watches, next)
+		if (!strcmp(w->path, path) && !strcmp(w->name, name)
+		    && (target == NULL ? w->target == NULL
+		    : w->target != NULL && !strcmp(w->target, target)))
+			return;
+
+#if defined(LT_INOTIFY)
+	if ((wd = inotify_add_watch(ctx->wfd, path, IN_CLOSE_WRITE | IN_CREATE
+	    | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM
+	    | IN_MOVED_TO)) == -1)
+		return;
+#elif defined(LT_KQUEUE)
+	if ((wd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return;
+#else
+	return;
+#endif
+	if ((w = calloc(1, sizeof(struct lt_watch))) == NULL
+	    || (w->path = strdup(path)) == NULL
+	    || (w->name = strdup(name)) == NULL
+	    || (target != NULL && (w->target = strdup(target)) == NULL)) {
+		if (w != NULL)
+			free_watch(w);
+#ifdef LT_KQUEUE
+		close(wd);
+#endif
+		return;
+	}
+	w->wd = wd;
+	w->isdir = isdir;
+#ifdef LT_KQUEUE
+	EV_SET(&ev, wd, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE
+	    | NOTE_DELETE | NOTE_RENAME | NOTE_EXTEND | NOTE_ATTRIB, 0, w);
+	kevent(ctx->wfd, &ev, 1, NULL, 0, NULL);
+#endif
+	SLIST_INSERT_HEAD(&ctx->watches, w, next);
+}
+
+/* Add watches for a template that process_file() found at path */
+void
+lt_watch_add(struct render_context *ctx, const char *fnam, const char *path)
+{
+	char dir[PATH_MAX], root[PATH_MAX];
+	char **roots;
+	const char *p;
+	size_t len;
+
+	if ((p = strrchr(fnam, '/')) != NULL)
+		len = p - fnam;
+	else
+		len = 0;
+	if (len >= sizeof dir)
+		return;
+	memcpy(dir, fnam, len);
+	dir[len] = '\0';
+
+	/* New files in any root of the search path may take precedence */
+	roots = ctx->roots != NULL ? ctx->roots : lt_default_roots;
+	for (; *roots != NULL; roots++) {
+		if (**roots == '\0')
+			snprintf(root, sizeof root, "%s", len ? dir : ".");
+		else
+			snprintf(root, sizeof root, len ? "%s/%s" : "%s%s",
+			    *roots, dir);
+		watch_path(ctx, root, dir, 1);
+	}
+#ifdef LT_KQUEUE
+	/* Directory events do not cover changes to the files themselves */
+	watch_path(ctx, path, fnam, 0);
+#endif
+}
+
+#if defined(LT_INOTIFY) || defined(LT_KQUEUE)
+/* Invalidate every template in directory name */
+static void
+invalidate_dir(lua_State *L, int container, const char *name)
+{
+	const char *fnam, *p;
+	size_t len;
+	int n, t;
+
+	len = strlen(name);
+	lua_getfield(L, container, "template");
+	t = lua_gettop(L);
+	lua_newtable(L);
+	n = 0;
+	lua_pushnil(L);
+	while (lua_next(L, t)) {
+		lua_pop(L, 1);
+		fnam = lua_tostring(L, -1);
+		p = strrchr(fnam, '/');
+		if ((p == NULL && len == 0) || (p != NULL
+		    && (size_t)(p - fnam) == len && !strncmp(fnam, name, len))) {
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, t + 1, ++n);
+		}
+	}
+	for (; n > 0; n--) {
+		lua_rawgeti(L, t + 1, n);
+		lt_invalidate(L, container, lua_tostring(L, -1));
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 2);
+}
+
+static void
+unwatch(struct render_context *ctx, struct lt_watch *w)
+{
+	SLIST_REMOVE(&ctx->watches, w, lt_watch, next);
+#ifdef LT_KQUEUE
+	close(w->wd);
+#endif
+	free_watch(w);
+}
+
+/*
+ * Something changed in the parent watched for the directory w waits for.
+ * The directory, or a nearer parent, is watched again.  Once it exists,
+ * its files may override any template of the directory it maps to.
+ */
+static void
+waited(lua_State *L, struct render_context *ctx, int container,
+    struct lt_watch *w)
+{
+	struct stat sb;
+
+	watch_path(ctx, w->target, w->name, 1);
+	if (!stat(w->target, &sb)) {
+		invalidate_dir(L, container, w->name);
+		unwatch(ctx, w);
+	}
+}
+#endif
+
+/*
+ * Read all pending events without blocking and invalidate the templates
+ * they concern.
+ */
+void
+lt_watch_drain(lua_State *L, struct render_context *ctx, int container)
+{
+	struct lt_watch *w, *nw;
+#if defined(LT_INOTIFY)
+	char buf[4096]
+	    __attribute__((aligned(__alignof__(struct inotify_event))));
+	char fnam[PATH_MAX];
+	struct inotify_event *ev;
+	ssize_t n;
+	char *p;
+
+	while ((n = read(ctx->wfd, buf, sizeof buf)) > 0) {
+		for (p = buf; p < buf + n;
+		    p += sizeof(struct inotify_event) + ev->len) {
+			ev = (struct inotify_event *)p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				lt_flush(L, container);
+				continue;
+			}
+			/* A directory may be watched for several names */
+			for (w = SLIST_FIRST(&ctx->watches); w != NULL;
+			    w = nw) {
+				nw = SLIST_NEXT(w, next);
+				if (w->wd != ev->wd)
+					continue;
+				if (ev->mask & IN_IGNORED) {
+					/* The directory is gone */
+					unwatch(ctx, w);
+					continue;
+				}
+				if (w->target != NULL) {
+					waited(L, ctx, container, w);
+					continue;
+				}
+				if (ev->len == 0)
+					continue;
+				snprintf(fnam, sizeof fnam,
+				    *w->name ? "%s/%s" : "%s%s", w->name,
+				    ev->name);
+				lt_invalidate(L, container, fnam);
+			}
+		}
+	}
+#elif defined(LT_KQUEUE)
+	struct kevent ev[16];
+	struct timespec zero = { 0, 0 };
+	int i, n;
+
+	while ((n = kevent(ctx->wfd, NULL, 0, ev, 16, &zero)) > 0) {
+		for (i = 0; i < n; i++) {
+			w = ev[i].udata;
+			if (w->target != NULL) {
+				waited(L, ctx, container, w);
+				continue;
+			}
+			if (w->isdir) {
+				invalidate_dir(L, container, w->name);
+				continue;
+			}
+
+			/*
+			 * The file may have been replaced, it is watched again
+			 * when the template is compiled the next time.
+			 */
+			lt_invalidate(L, container, w->name);
+			unwatch(ctx, w);
+		}
+		if (n < 16)
+			break;
+	}
+#endif
+}